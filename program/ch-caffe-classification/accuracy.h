@@ -0,0 +1,76 @@
+#ifndef ACCURACY_H
+#define ACCURACY_H
+
+#include "../ch-caffe-core/topk.h"
+
+#include <algorithm>
+#include <atomic>
+#include <fstream>
+#include <sstream>
+#include <string>
+#include <unordered_map>
+#include <vector>
+
+/* Ground truth labels of the given images from a file in the format of
+ * ImageNet `val.txt`: image file name and label index on every line.
+ * Images are matched by file name, labels of images not found in the
+ * file are -1. Returns an empty vector if the file can't be read. */
+inline std::vector<int> load_ground_truth(const std::string& file_name,
+                                          const std::vector<std::string>& images) {
+  std::ifstream file(file_name.c_str());
+  if (!file)
+    return std::vector<int>();
+
+  std::unordered_map<std::string, int> image_index;
+  for (size_t i = 0; i < images.size(); ++i) {
+    const size_t slash = images[i].find_last_of('/');
+    image_index[slash == std::string::npos ? images[i] : images[i].substr(slash + 1)] = i;
+  }
+
+  std::vector<int> labels(images.size(), -1);
+  std::string line, name;
+  int label;
+  while (std::getline(file, line)) {
+    std::istringstream tokens(line);
+    if (!(tokens >> name >> label))
+      continue;
+    std::unordered_map<std::string, int>::const_iterator it = image_index.find(name);
+    if (it != image_index.end())
+      labels[it->second] = label;
+  }
+  return labels;
+}
+
+/* Top-1 and top-5 accuracy over classified images.
+ * Counters are atomic, so several threads can add results. */
+class AccuracyCounter {
+public:
+  AccuracyCounter(): images_(0), top1_(0), top5_(0) {}
+
+  // Account predictions of an image with known ground truth label.
+  template <int K>
+  void Add(const TopK<K>& top, int label) {
+    if (label < 0)
+      return;
+    images_++;
+    const int count = std::min(top.count, 5);
+    for (int i = 0; i < count; ++i)
+      if (top.index[i] == label) {
+        if (i == 0)
+          top1_++;
+        top5_++;
+        break;
+      }
+  }
+
+  int images() const { return images_; }
+  double top1() const { return images_ ? double(top1_) / images_ : 0; }
+  double top5() const { return images_ ? double(top5_) / images_ : 0; }
+
+private:
+  std::atomic<int> images_;
+  std::atomic<int> top1_;
+  std::atomic<int> top5_;
+};
+
+#endif // ACCURACY_H
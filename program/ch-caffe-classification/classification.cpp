@@ -1,8 +1,23 @@
+#include "accuracy.h"
 #include "classifier.h"
+#include "image_pipeline.h"
+#include "../ch-caffe-core/affinity.h"
+#include "../ch-caffe-core/image_cache.h"
+#include "../ch-caffe-core/image_source.h"
+#include "../ch-caffe-core/jpeg_decode.h"
+#include "../ch-caffe-core/json_writer.h"
+#include "../ch-caffe-core/lmdb_reader.h"
+#include "../ch-caffe-core/stage_timer.h"
+#include "../ch-caffe-core/warmup.h"
 
+#include <atomic>
 #include <chrono>
+#include <condition_variable>
+#include <memory>
+#include <mutex>
+#include <thread>
+#include <unordered_set>
 
-#include <boost/algorithm/string.hpp>
 #include <boost/filesystem.hpp>
 
 using namespace std;
@@ -13,6 +28,10 @@ int getenv_i(const char* name, int def) {
   return getenv(name) ? atoi(getenv(name)) : def;
 }
 
+double getenv_f(const char* name, double def) {
+  return getenv(name) ? atof(getenv(name)) : def;
+}
+
 string getenv_s(const char* name) {
   const char* val = getenv(name);
   if (!val || strlen(val) == 0) {
@@ -22,51 +41,463 @@ string getenv_s(const char* name) {
   return string(val);
 }
 
+string getenv_s(const char* name, const string& def) {
+  const char* val = getenv(name);
+  return val ? string(val) : def;
+}
+
 const int BATCH_COUNT = getenv_i("CK_BATCH_COUNT", 1);
 const int BATCH_SIZE = getenv_i("CK_BATCH_SIZE", 1);
 const int IMAGES_COUNT = BATCH_COUNT * BATCH_SIZE;
 const int SKIP_IMAGES = getenv_i("CK_SKIP_IMAGES", 0);
+const int WARMUP_ITERS = getenv_i("CK_WARMUP_ITERS", BATCH_COUNT > 1 ? 1 : 0);
+const double WARMUP_CV = getenv_f("CK_WARMUP_CV", 0);
+const int WARMUP_WINDOW = getenv_i("CK_WARMUP_WINDOW", 5);
+const int WARMUP_MAX_ITERS = getenv_i("CK_WARMUP_MAX_ITERS", BATCH_COUNT / 2);
+const int DECODE_THREADS = getenv_i("CK_DECODE_THREADS", 0);
+const int PREFETCH_DEPTH = getenv_i("CK_PREFETCH_DEPTH", 2);
 const string IMAGES_DIR = getenv_s("CK_ENV_DATASET_IMAGENET_VAL");
+const string IMAGE_LIST = getenv_s("CK_IMAGE_LIST", "");
 const string WEIGHTS_FILE = getenv_s("CK_ENV_MODEL_CAFFE_WEIGHTS");
 const string TMP_MODEL_FILE = "tmp.prototxt";
 const string MODEL_FILE = (fs::path(getenv_s("CK_ENV_MODEL_CAFFE"))/"deploy.prototxt").native();
 const string MEAN_FILE = (fs::path(getenv_s("CK_ENV_DATASET_IMAGENET_AUX"))/"imagenet_mean.binaryproto").native();
 const string LABELS_FILE = (fs::path(getenv_s("CK_ENV_DATASET_IMAGENET_AUX"))/"synset_words.txt").native();
+const string GROUND_TRUTH_FILE = (fs::path(getenv_s("CK_ENV_DATASET_IMAGENET_AUX"))/"val.txt").native();
+const string TIMER_FILE = getenv_s("CK_TIMER_FILE", "tmp-ck-timer.json");
+const string RESULTS_FILE = getenv_s("CK_RESULTS_FILE", "tmp-results.json");
+const bool LAYER_TIMING = getenv_i("CK_LAYER_TIMING", 0) != 0;
+const string LAYER_TIMING_FILE = getenv_s("CK_LAYER_TIMING_FILE", "tmp-layer-timing.json");
+const string IMAGE_CACHE = getenv_s("CK_IMAGE_CACHE", "");
+const string TENSOR_LMDB = getenv_s("CK_TENSOR_LMDB", "");
+const bool REDUCED_DECODE = getenv_i("CK_REDUCED_DECODE", 0) != 0;
+const int INSTANCES = getenv_i("CK_INSTANCES", 1);
+const int CORES_PER_INSTANCE = getenv_i("CK_CORES_PER_INSTANCE", 0);
+const int BLAS_THREADS = getenv_i("CK_BLAS_THREADS", 0);
+const bool SHARE_WEIGHTS = getenv_i("CK_SHARE_WEIGHTS", 1) != 0;
 
-vector<string> get_images() {
-  const string filter1(".JPG");
-  const string filter2(".JPEG");
+template <typename T>
+void str_replace(string& str, const string& from, const T& to) {
+  size_t pos = str.find(from);
+  if (pos != string::npos) {
+    stringstream tmp; tmp << to;
+    str.replace(pos, from.size(), tmp.str());
+  }
+}
 
-  vector<string> all_images;
-  fs::directory_iterator end_iter;
-  for (fs::directory_iterator dir_iter(IMAGES_DIR) ; dir_iter != end_iter ; ++dir_iter){
-    if (!fs::is_regular_file(dir_iter->status())) continue;
+// Target size of reduced decoding recorded in the image cache,
+// so a cache made in the other decode mode is not used.
+cv::Size reduced_target(cv::Size input_geometry) {
+  return REDUCED_DECODE ? input_geometry : cv::Size();
+}
 
-    string file = dir_iter->path().string();
+cv::Mat load_image(const string& image_file, cv::Size input_geometry) {
+  cv::Mat img = REDUCED_DECODE ? decode_image_reduced(image_file, input_geometry)
+                               : cv::imread(image_file, -1);
+  CHECK(!img.empty()) << "Unable to decode image " << image_file;
+  return img;
+}
 
-    string tmp = boost::to_upper_copy(file);
-    if (tmp.compare(file.size()-filter1.size(), filter1.size(), filter1) != 0 &&
-        tmp.compare(file.size()-filter2.size(), filter2.size(), filter2) != 0) continue;
+void print_predictions(ostream& out, const Classifier& classifier,
+                       const string* image_files, const TopPredictions* top_predictions, int count) {
+  for (int i = 0; i < count; i++) {
+    out << endl << fs::path(image_files[i]).filename().native() << endl;
 
-    all_images.push_back(file);
+    const TopPredictions& top = top_predictions[i];
+    for (int j = 0; j < top.count; ++j)
+      out << fixed << setprecision(4) << top.score[j] << " - " << classifier.GetLabel(top.index[j]) << endl;
   }
+}
+
+// Warmup of a loop over the given number of batches.
+WarmupDetector make_warmup(int batches) {
+  return WarmupDetector::ForBatches(batches, WARMUP_ITERS, WARMUP_CV, WARMUP_WINDOW, WARMUP_MAX_ITERS);
+}
 
-  sort(all_images.begin(), all_images.end());
+// Results file: configuration, predictions of every image streamed during
+// classification, then summary and stage timings.
+void begin_results(JsonWriter& json) {
+  json.BeginObject().Field("program", "ch-caffe-classification");
+  json.Key("config").BeginObject()
+      .Field("model_file", MODEL_FILE)
+      .Field("weights_file", WEIGHTS_FILE)
+      .Field("mean_file", MEAN_FILE)
+      .Field("labels_file", LABELS_FILE)
+      .Field("images_dir", IMAGES_DIR)
+      .Field("image_list", IMAGE_LIST)
+      .Field("batch_count", BATCH_COUNT)
+      .Field("batch_size", BATCH_SIZE)
+      .Field("skip_images", SKIP_IMAGES)
+      .Field("warmup_iters", WARMUP_ITERS)
+      .Field("warmup_cv", WARMUP_CV)
+      .Field("decode_threads", DECODE_THREADS)
+      .Field("prefetch_depth", PREFETCH_DEPTH)
+      .Field("reduced_decode", REDUCED_DECODE)
+      .Field("image_cache", IMAGE_CACHE)
+      .Field("tensor_lmdb", TENSOR_LMDB)
+      .Field("instances", INSTANCES)
+      .Field("layer_timing", LAYER_TIMING)
+      .EndObject();
+  json.Key("images").BeginArray();
+}
 
-  int last_index = SKIP_IMAGES + IMAGES_COUNT;
-  if (last_index >= all_images.size())
-    last_index = all_images.size()-1;
+// Every image is an object with file name, batch index, ground truth label
+// when known and top predictions as [label index, score] pairs.
+void write_predictions(JsonWriter& json, int batch_index, const string* image_files,
+                       const TopPredictions* top_predictions, const int* labels, int count) {
+  for (int i = 0; i < count; i++) {
+    json.BeginObject()
+        .Field("file", fs::path(image_files[i]).filename().native())
+        .Field("batch", batch_index);
+    if (labels && labels[i] >= 0)
+      json.Field("label", labels[i]);
+    const TopPredictions& top = top_predictions[i];
+    json.Key("top").BeginArray();
+    for (int j = 0; j < top.count; ++j)
+      json.BeginArray().Value(top.index[j]).Value(double(top.score[j])).EndArray();
+    json.EndArray().EndObject();
+  }
+}
 
-  return vector<string>(&all_images[SKIP_IMAGES], &all_images[last_index]);
+void end_results(JsonWriter& json, const StageTimer& timer, int images_processed, int warmup_batches,
+                 double class_avg_time, double class_throughput, double end_to_end_throughput,
+                 const AccuracyCounter& accuracy) {
+  json.EndArray();
+  json.Key("summary").BeginObject()
+      .Field("images_processed", images_processed)
+      .Field("warmup_batches", warmup_batches)
+      .Field("avg_classification_time_s", class_avg_time)
+      .Field("classification_throughput", class_throughput)
+      .Field("end_to_end_throughput", end_to_end_throughput);
+  if (accuracy.images() > 0)
+    json.Field("accuracy_images", accuracy.images())
+        .Field("top1", accuracy.top1())
+        .Field("top5", accuracy.top5());
+  json.EndObject();
+  json.Key("stages_ms");
+  timer.WriteJson(json);
+  json.EndObject();
 }
 
-template <typename T>
-void str_replace(string& str, const string& from, const T& to) {
-  size_t pos = str.find(from);
-  if (pos != string::npos) {
-    stringstream tmp; tmp << to;
-    str.replace(pos, from.size(), tmp.str());
+void print_accuracy(const AccuracyCounter& accuracy) {
+  if (accuracy.images() == 0)
+    return;
+  cout << "Top-1 accuracy: " << accuracy.top1() << " (" << accuracy.images() << " images)" << endl;
+  cout << "Top-5 accuracy: " << accuracy.top5() << endl;
+}
+
+// Run several classifiers side by side, every one in its own thread pinned
+// to its own cores. Instances take next batch from a shared counter as soon
+// as they are done with the previous one, so faster instances do more work.
+// Images are decoded by the instance itself, on its cores. BLAS worker
+// threads are not pinned, so BLAS runs single-threaded by default and
+// every instance computes in its own pinned thread.
+int classify_instances(const vector<string>& images, const vector<int>& ground_truth, JsonFile& results) {
+  const int cores_per_instance = CORES_PER_INSTANCE > 0 ? CORES_PER_INSTANCE
+                                                        : max(1, online_cores() / INSTANCES);
+  const int blas_threads = BLAS_THREADS > 0 ? BLAS_THREADS : 1;
+  cout << endl << "Cores per instance: " << cores_per_instance << endl;
+  cout << "Shared weights: " << (SHARE_WEIGHTS ? "on" : "off") << endl;
+  cout << "BLAS threads: " << blas_threads;
+  if (!set_blas_threads(blas_threads)) cout << " (not supported by BLAS library)";
+  cout << endl;
+
+  StageTimer timer;
+  const int DECODE_STAGE = timer.AddStage("decode", StageTimer::PER_IMAGE);
+  const int PREPROCESS_STAGE = timer.AddStage("preprocess", StageTimer::PER_IMAGE);
+  const int INPUT_STAGE = timer.AddStage("input", StageTimer::PER_BATCH);
+  const int FORWARD_STAGE = timer.AddStage("forward", StageTimer::PER_BATCH);
+  const int POSTPROCESS_STAGE = timer.AddStage("postprocess", StageTimer::PER_BATCH);
+
+  // Instances are built one by one in order, each on its own cores so its
+  // memory is allocated close to them. The first one loads weights, the
+  // others share them. Timing starts when all of them are ready.
+  vector<unique_ptr<Classifier> > classifiers(INSTANCES);
+  mutex init_mutex;
+  condition_variable init_cond;
+  int instances_built = 0;
+  mutex start_mutex;
+  condition_variable start_cond;
+  int instances_ready = 0;
+  mutex out_mutex;
+
+  atomic<int> next_batch(0);
+  AccuracyCounter accuracy;
+  vector<int> instance_batches(INSTANCES);
+  vector<int> instance_images(INSTANCES);
+  vector<double> instance_class_time(INSTANCES);
+  vector<char> instance_pinned(INSTANCES);
+  vector<int> instance_warmup(INSTANCES);
+  time_point<high_resolution_clock> loop_start_time;
+
+  auto run_instance = [&](int instance) {
+    instance_pinned[instance] = pin_current_thread(instance * cores_per_instance, cores_per_instance);
+
+    {
+      unique_lock<mutex> lock(init_mutex);
+      init_cond.wait(lock, [&] { return instances_built == instance; });
+      if (instance > 0 && SHARE_WEIGHTS)
+        classifiers[instance].reset(new Classifier(TMP_MODEL_FILE, *classifiers[0]));
+      else
+        classifiers[instance].reset(new Classifier(TMP_MODEL_FILE, WEIGHTS_FILE, MEAN_FILE, LABELS_FILE));
+      instances_built++;
+      init_cond.notify_all();
+    }
+    Classifier* classifier = classifiers[instance].get();
+    const cv::Size input_geometry = classifier->InputGeometry();
+
+    ImageCache cache;
+    bool use_cache = !IMAGE_CACHE.empty() &&
+      cache.Open(IMAGE_CACHE, input_geometry, classifier->NumChannels(), classifier->Mean(),
+                 reduced_target(input_geometry));
+    for (int i = 0; i < IMAGES_COUNT && use_cache; i++)
+      use_cache = cache.Find(images[i]) != nullptr;
+
+    vector<cv::Mat> prepared(BATCH_SIZE);
+    vector<const float*> cached_tensors(BATCH_SIZE);
+    vector<double> decode_times(BATCH_SIZE);
+    vector<double> prepare_times(BATCH_SIZE);
+    vector<TopPredictions> top_predictions(BATCH_SIZE);
+    ostringstream out;
+
+    {
+      unique_lock<mutex> lock(start_mutex);
+      if (++instances_ready == INSTANCES) {
+        loop_start_time = high_resolution_clock::now();
+        start_cond.notify_all();
+      }
+      else
+        start_cond.wait(lock, [&] { return instances_ready == INSTANCES; });
+    }
+
+    // Every instance warms up on its own first batches
+    WarmupDetector warmup = make_warmup(BATCH_COUNT / INSTANCES);
+    for (int batch_index = next_batch++; batch_index < BATCH_COUNT; batch_index = next_batch++) {
+      const bool measured = warmup.Measured();
+      const int image_index = batch_index * BATCH_SIZE;
+      time_point<high_resolution_clock> start_time;
+
+      duration<double> input_elapsed;
+      if (use_cache) {
+        for (int i = 0; i < BATCH_SIZE; i++)
+          cached_tensors[i] = cache.Find(images[image_index + i]);
+        start_time = high_resolution_clock::now();
+        classifier->SetInputTensors(cached_tensors.data(), BATCH_SIZE);
+        input_elapsed = high_resolution_clock::now() - start_time;
+      }
+      else {
+        for (int i = 0; i < BATCH_SIZE; i++) {
+          start_time = high_resolution_clock::now();
+          cv::Mat img = load_image(images[image_index + i], input_geometry);
+          time_point<high_resolution_clock> decoded_time = high_resolution_clock::now();
+          prepared[i] = classifier->PrepareImage(img, i);
+          decode_times[i] = duration<double>(decoded_time - start_time).count();
+          prepare_times[i] = duration<double>(high_resolution_clock::now() - decoded_time).count();
+        }
+        start_time = high_resolution_clock::now();
+        classifier->SetInput(prepared);
+        input_elapsed = high_resolution_clock::now() - start_time;
+      }
+
+      start_time = high_resolution_clock::now();
+      classifier->Forward();
+      duration<double> forward_elapsed = high_resolution_clock::now() - start_time;
+
+      // Output of the batch is printed at once, not mixed with other instances
+      start_time = high_resolution_clock::now();
+      OutputView output = classifier->Output();
+      top_k_batch(output.data, output.num, output.channels, top_predictions.data());
+      if (!ground_truth.empty())
+        for (int i = 0; i < BATCH_SIZE; i++)
+          accuracy.Add(top_predictions[i], ground_truth[image_index + i]);
+      out.str("");
+      out << "Batch " << batch_index << " (instance " << instance << ")" << endl;
+      print_predictions(out, *classifier, &images[image_index], top_predictions.data(), BATCH_SIZE);
+      {
+        lock_guard<mutex> lock(out_mutex);
+        cout << out.str();
+        if (results.enabled())
+          write_predictions(results.json(), batch_index, &images[image_index], top_predictions.data(),
+                            ground_truth.empty() ? nullptr : &ground_truth[image_index], BATCH_SIZE);
+      }
+      duration<double> postprocess_elapsed = high_resolution_clock::now() - start_time;
+
+      if (measured) {
+        if (!use_cache) {
+          timer.RecordImages(DECODE_STAGE, decode_times.data(), BATCH_SIZE);
+          timer.RecordImages(PREPROCESS_STAGE, prepare_times.data(), BATCH_SIZE);
+        }
+        timer.RecordBatch(INPUT_STAGE, input_elapsed.count(), BATCH_SIZE);
+        timer.RecordBatch(FORWARD_STAGE, forward_elapsed.count(), BATCH_SIZE);
+        timer.RecordBatch(POSTPROCESS_STAGE, postprocess_elapsed.count(), BATCH_SIZE);
+        instance_class_time[instance] += input_elapsed.count() + forward_elapsed.count();
+        instance_images[instance] += BATCH_SIZE;
+      }
+      warmup.Add(input_elapsed.count() + forward_elapsed.count());
+      instance_batches[instance]++;
+    }
+    instance_warmup[instance] = warmup.Discarded();
+  };
+
+  cout << endl << "Classify..." << endl;
+  vector<thread> threads;
+  for (int i = 0; i < INSTANCES; i++)
+    threads.push_back(thread(run_instance, i));
+  for (size_t i = 0; i < threads.size(); i++)
+    threads[i].join();
+  duration<double> loop_elapsed = high_resolution_clock::now() - loop_start_time;
+
+  int images_processed = 0;
+  int warmup_batches = 0;
+  double class_total_time = 0;
+  cout << endl;
+  for (int i = 0; i < INSTANCES; i++) {
+    cout << "Instance " << i << ": " << instance_batches[i] << " batches ("
+         << instance_warmup[i] << " warmup), cores "
+         << i * cores_per_instance << "-" << (i + 1) * cores_per_instance - 1
+         << (instance_pinned[i] ? "" : " (not pinned)") << endl;
+    images_processed += instance_images[i];
+    warmup_batches += instance_warmup[i];
+    class_total_time += instance_class_time[i];
   }
+  double class_avg_time = class_total_time / double(images_processed);
+
+  cout << "Images processed: " << images_processed << endl;
+  cout << "Warmup batches discarded: " << warmup_batches << endl;
+  cout << "Average classification time per instance: " << class_avg_time << "s" << endl;
+  cout << "Aggregate classification throughput: " << INSTANCES / class_avg_time << " images/s" << endl;
+  cout << "End-to-end throughput: " << IMAGES_COUNT / loop_elapsed.count() << " images/s" << endl;
+  print_accuracy(accuracy);
+
+  cout << endl;
+  timer.Print(cout);
+  if (!TIMER_FILE.empty())
+    timer.WriteJson(TIMER_FILE);
+  if (results.enabled()) {
+    end_results(results.json(), timer, images_processed, warmup_batches, class_avg_time,
+                INSTANCES / class_avg_time, IMAGES_COUNT / loop_elapsed.count(), accuracy);
+    results.Close();
+  }
+
+  return 0;
+}
+
+// Classify records of an LMDB database of Datum messages with packed
+// float_data holding input tensors already preprocessed for the network.
+// Records are read in key order straight from memory mapped pages and their
+// tensors are copied into the input layer, nothing is decoded or resized.
+// Ground truth labels are taken from records.
+int classify_tensor_lmdb(JsonFile& results) {
+  cout << endl << "Initializing classifier..." << endl;
+  time_point<high_resolution_clock> start_time = high_resolution_clock::now();
+  Classifier classifier(TMP_MODEL_FILE, WEIGHTS_FILE, MEAN_FILE, LABELS_FILE);
+  duration<double> elapsed = high_resolution_clock::now() - start_time;
+  cout << "Classifier initialised in " << elapsed.count() << "s" << endl;
+  classifier.EnableLayerTiming(LAYER_TIMING);
+
+  StageTimer timer;
+  const int INPUT_STAGE = timer.AddStage("input", StageTimer::PER_BATCH);
+  const int FORWARD_STAGE = timer.AddStage("forward", StageTimer::PER_BATCH);
+  const int POSTPROCESS_STAGE = timer.AddStage("postprocess", StageTimer::PER_BATCH);
+
+  // Records stay valid while the reader is open
+  LmdbDatumReader reader(TENSOR_LMDB);
+  LmdbIterator record = reader.begin();
+  for (int i = 0; i < SKIP_IMAGES && record != reader.end(); i++)
+    ++record;
+
+  cout << endl << "Classify..." << endl;
+  vector<CaffeDatum> datums(BATCH_SIZE);
+  vector<const CaffeDatum*> batch_datums(BATCH_SIZE);
+  vector<string> keys(BATCH_SIZE);
+  vector<int> labels(BATCH_SIZE);
+  vector<TopPredictions> top_predictions(BATCH_SIZE);
+  AccuracyCounter accuracy;
+  double class_total_time = 0;
+  int images_processed = 0;
+  WarmupDetector warmup = make_warmup(BATCH_COUNT);
+  time_point<high_resolution_clock> loop_start_time = high_resolution_clock::now();
+  for (int batch_index = 0; batch_index < BATCH_COUNT; batch_index++) {
+    cout << "Batch " << batch_index << endl;
+
+    // Exclude warmup batches from averaging
+    const bool measured = warmup.Measured();
+
+    for (int i = 0; i < BATCH_SIZE; i++, ++record) {
+      CHECK(record != reader.end()) << "Not enough records for the requested batches.";
+      datums[i] = record->datum;
+      batch_datums[i] = &datums[i];
+      keys[i] = record->key_str();
+      labels[i] = record->datum.label;
+    }
+
+    // Write batch into the network
+    start_time = high_resolution_clock::now();
+    classifier.SetInputDatums(batch_datums.data(), BATCH_SIZE);
+    duration<double> input_elapsed = high_resolution_clock::now() - start_time;
+
+    // Classify batch
+    start_time = high_resolution_clock::now();
+    classifier.Forward();
+    duration<double> forward_elapsed = high_resolution_clock::now() - start_time;
+
+    // Print the top N predictions for every image of the batch.
+    start_time = high_resolution_clock::now();
+    OutputView output = classifier.Output();
+    top_k_batch(output.data, output.num, output.channels, top_predictions.data());
+    for (int i = 0; i < BATCH_SIZE; i++)
+      accuracy.Add(top_predictions[i], labels[i]);
+    print_predictions(cout, classifier, keys.data(), top_predictions.data(), BATCH_SIZE);
+    if (results.enabled())
+      write_predictions(results.json(), batch_index, keys.data(), top_predictions.data(),
+                        labels.data(), BATCH_SIZE);
+    duration<double> postprocess_elapsed = high_resolution_clock::now() - start_time;
+
+    if (measured) {
+      timer.RecordBatch(INPUT_STAGE, input_elapsed.count(), BATCH_SIZE);
+      timer.RecordBatch(FORWARD_STAGE, forward_elapsed.count(), BATCH_SIZE);
+      timer.RecordBatch(POSTPROCESS_STAGE, postprocess_elapsed.count(), BATCH_SIZE);
+      class_total_time += input_elapsed.count() + forward_elapsed.count();
+      images_processed += BATCH_SIZE;
+    }
+    else {
+      // Layer timings of warmup batches are excluded too
+      classifier.ResetLayerTimings();
+    }
+    warmup.Add(input_elapsed.count() + forward_elapsed.count());
+  }
+  duration<double> loop_elapsed = high_resolution_clock::now() - loop_start_time;
+
+  double class_avg_time = class_total_time / double(images_processed);
+
+  cout << endl;
+  cout << "Images processed: " << images_processed << endl;
+  warmup.Print(cout);
+  cout << "Network reshapes: " << classifier.ReshapeCount() << endl;
+  cout << "All images classified in " << class_total_time << "s" << endl;
+  cout << "Average classification time: " << class_avg_time << "s" << endl;
+  cout << "Classification throughput: " << 1.0 / class_avg_time << " images/s" << endl;
+  cout << "End-to-end throughput: " << IMAGES_COUNT / loop_elapsed.count() << " images/s" << endl;
+  print_accuracy(accuracy);
+
+  cout << endl;
+  timer.Print(cout);
+  if (!TIMER_FILE.empty())
+    timer.WriteJson(TIMER_FILE);
+  if (results.enabled()) {
+    end_results(results.json(), timer, images_processed, warmup.Discarded(), class_avg_time,
+                1.0 / class_avg_time, IMAGES_COUNT / loop_elapsed.count(), accuracy);
+    results.Close();
+  }
+
+  if (LAYER_TIMING) {
+    cout << endl;
+    classifier.PrintLayerTimings(cout);
+    if (!LAYER_TIMING_FILE.empty())
+      classifier.WriteLayerTimingsJson(LAYER_TIMING_FILE);
+  }
+
+  return 0;
 }
 
 int main(int argc, char** argv) {
@@ -77,9 +508,20 @@ int main(int argc, char** argv) {
   cout << "Weights file: " << WEIGHTS_FILE << endl;
   cout << "Mean file: " << MEAN_FILE << endl;
   cout << "Labels file: " << LABELS_FILE << endl;
+  cout << "Ground truth file: " << GROUND_TRUTH_FILE << endl;
   cout << "Images dir: " << IMAGES_DIR << endl;
+  if (!IMAGE_LIST.empty()) cout << "Image list: " << IMAGE_LIST << endl;
   cout << "Batch count: " << BATCH_COUNT << endl;
   cout << "Batch size: " << BATCH_SIZE << endl;
+  cout << "Warmup batches: " << WARMUP_ITERS << endl;
+  if (WARMUP_CV > 0) cout << "Warmup CV threshold: " << WARMUP_CV << " over " << WARMUP_WINDOW << " batches" << endl;
+  cout << "Decode threads: " << DECODE_THREADS << endl;
+  cout << "Prefetch depth: " << PREFETCH_DEPTH << endl;
+  cout << "Layer timing: " << (LAYER_TIMING ? "on" : "off") << endl;
+  if (!IMAGE_CACHE.empty()) cout << "Image cache: " << IMAGE_CACHE << endl;
+  if (!TENSOR_LMDB.empty()) cout << "Tensor LMDB: " << TENSOR_LMDB << endl;
+  cout << "Reduced decode: " << (REDUCED_DECODE ? "on" : "off") << endl;
+  cout << "Instances: " << INSTANCES << endl;
 
   // Prepare prototxt
   cout << endl << "Preparing prototxt..." << endl;
@@ -88,9 +530,25 @@ int main(int argc, char** argv) {
   str_replace(prototxt, "$#batch_size#$", BATCH_SIZE);
   ofstream(TMP_MODEL_FILE, ofstream::trunc) << prototxt;
 
+  JsonFile results(RESULTS_FILE);
+  if (results.enabled())
+    begin_results(results.json());
+
+  if (!TENSOR_LMDB.empty())
+    return classify_tensor_lmdb(results);
+
   // Load processing image filenames
   cout << endl << "Loading image list..." << endl;
-  vector<string> images = get_images();
+  vector<string> images = list_images(IMAGES_DIR, IMAGE_LIST, SKIP_IMAGES, IMAGES_COUNT);
+  CHECK_EQ(images.size(), IMAGES_COUNT) << "Not enough images for the requested batches.";
+
+  // Labels of images to check predictions against
+  vector<int> ground_truth = load_ground_truth(GROUND_TRUTH_FILE, images);
+  if (ground_truth.empty())
+    cout << "Ground truth file is not found, accuracy is not computed" << endl;
+
+  if (INSTANCES > 1)
+    return classify_instances(images, ground_truth, results);
 
   // Build net
   cout << endl << "Initializing classifier..." << endl;
@@ -98,59 +556,180 @@ int main(int argc, char** argv) {
   Classifier classifier(TMP_MODEL_FILE, WEIGHTS_FILE, MEAN_FILE, LABELS_FILE);
   duration<double> elapsed = high_resolution_clock::now() - start_time;  
   cout << "Classifier initialised in " << elapsed.count() << "s" << endl;
+  classifier.EnableLayerTiming(LAYER_TIMING);
+
+  // Timings of processing stages
+  StageTimer timer;
+  const int DECODE_STAGE = timer.AddStage("decode", StageTimer::PER_IMAGE);
+  const int PREPROCESS_STAGE = timer.AddStage("preprocess", StageTimer::PER_IMAGE);
+  const int INPUT_STAGE = timer.AddStage("input", StageTimer::PER_BATCH);
+  const int FORWARD_STAGE = timer.AddStage("forward", StageTimer::PER_BATCH);
+  const int POSTPROCESS_STAGE = timer.AddStage("postprocess", StageTimer::PER_BATCH);
+
+  // Images preprocessed by previous runs are fed straight from the cache
+  // when all of them are there, otherwise the cache is rebuilt by this run
+  ImageCache cache;
+  bool use_cache = false;
+  unique_ptr<ImageCacheWriter> cache_writer;
+  if (!IMAGE_CACHE.empty()) {
+    cout << endl << "Loading image cache..." << endl;
+    if (cache.Open(IMAGE_CACHE, classifier.InputGeometry(), classifier.NumChannels(), classifier.Mean(),
+                   reduced_target(classifier.InputGeometry()))) {
+      use_cache = true;
+      for (int i = 0; i < IMAGES_COUNT && use_cache; i++)
+        use_cache = cache.Find(images[i]) != nullptr;
+    }
+    if (use_cache)
+      cout << "All images are found in the cache" << endl;
+    else {
+      cout << "Images are not cached, the cache will be updated" << endl;
+      cache_writer.reset(new ImageCacheWriter(IMAGE_CACHE, classifier.InputGeometry(),
+                                              classifier.NumChannels(), classifier.Mean(),
+                                              reduced_target(classifier.InputGeometry())));
+      // Keep images cached by other runs
+      unordered_set<string> run_images(images.begin(), images.end());
+      for (int i = 0; i < cache.size(); i++)
+        if (run_images.count(cache.Path(i)) == 0)
+          cache_writer->Add(cache.Path(i), cache.Tensor(i));
+    }
+  }
+  vector<const float*> cached_tensors(BATCH_SIZE);
+
+  // Decode and prepare images ahead of classification,
+  // every image of the pipeline ring is resized into its own arena slot
+  classifier.ReservePrepareSlots(max(PREFETCH_DEPTH, 1) * BATCH_SIZE);
+  const cv::Size input_geometry = classifier.InputGeometry();
+  auto decode_image = [input_geometry](const string& image_file) {
+    return load_image(image_file, input_geometry);
+  };
+  auto prepare_image = [&classifier](const cv::Mat& img, int slot) {
+    return classifier.PrepareImage(img, slot);
+  };
+  unique_ptr<ImagePipeline> pipeline;
+  if (!use_cache)
+    pipeline.reset(new ImagePipeline(images, BATCH_SIZE, BATCH_COUNT, decode_image, prepare_image,
+                                     DECODE_THREADS, PREFETCH_DEPTH));
 
   // Run batched mode
   cout << endl << "Classify..." << endl;
+  vector<TopPredictions> top_predictions(BATCH_SIZE);
+  AccuracyCounter accuracy;
   double load_total_time = 0;
+  double wait_total_time = 0;
   double class_total_time = 0;
   int image_index = 0;
   int images_processed = 0;
+  WarmupDetector warmup = make_warmup(BATCH_COUNT);
+  time_point<high_resolution_clock> loop_start_time = high_resolution_clock::now();
   for (int batch_index = 0; batch_index < BATCH_COUNT; batch_index++) {
     cout << "Batch " << batch_index << endl;
 
-    // Classify batch
-    for (int i = 0; i < BATCH_SIZE; i++) {
-      cout << endl << fs::path(images[image_index]).filename().native() << endl;
+    // Exclude warmup batches from averaging
+    const bool measured = warmup.Measured();
 
-      // Load image
+    duration<double> input_elapsed;
+    if (use_cache) {
+      // Write cached batch into the network
+      for (int i = 0; i < BATCH_SIZE; i++)
+        cached_tensors[i] = cache.Find(images[image_index + i]);
       start_time = high_resolution_clock::now();
-      cv::Mat img = cv::imread(images[image_index], -1);
-      CHECK(!img.empty()) << "Unable to decode image " << images[image_index];
-      cv::Mat img_prepared = classifier.PrepareImage(img);
-      elapsed = high_resolution_clock::now() - start_time;  
-      load_total_time += elapsed.count();
-
-      // Classify
+      classifier.SetInputTensors(cached_tensors.data(), BATCH_SIZE);
+      input_elapsed = high_resolution_clock::now() - start_time;
+    }
+    else {
+      // Wait for prepared batch
       start_time = high_resolution_clock::now();
-      vector<float> probs = classifier.Predict(img_prepared);
-      elapsed = high_resolution_clock::now() - start_time;  
-
-      // Print the top N predictions.
-      vector<Prediction> predictions = classifier.ProcessPredictions(probs);
-      for (size_t i = 0; i < predictions.size(); ++i) {
-        Prediction p = predictions[i];
-        cout << fixed << setprecision(4) << p.second << " - " << p.first << endl;
+      const PreparedBatch& batch = pipeline->Acquire(batch_index);
+      elapsed = high_resolution_clock::now() - start_time;
+      wait_total_time += elapsed.count();
+      for (int i = 0; i < BATCH_SIZE; i++)
+        load_total_time += batch.decode_times[i] + batch.prepare_times[i];
+      if (measured) {
+        timer.RecordImages(DECODE_STAGE, batch.decode_times.data(), BATCH_SIZE);
+        timer.RecordImages(PREPROCESS_STAGE, batch.prepare_times.data(), BATCH_SIZE);
       }
 
-      // Exclude first batch from averaging
-      if (batch_index > 0 || BATCH_COUNT == 1) {
-        class_total_time += elapsed.count();
-        images_processed += BATCH_SIZE;
-      }
+      // Write batch into the network
+      start_time = high_resolution_clock::now();
+      classifier.SetInput(batch.images);
+      input_elapsed = high_resolution_clock::now() - start_time;
+      pipeline->Release(batch_index);
+
+      if (cache_writer)
+        for (int i = 0; i < BATCH_SIZE; i++)
+          cache_writer->Add(images[image_index + i], classifier.InputTensor(i));
+    }
+
+    // Classify batch
+    start_time = high_resolution_clock::now();
+    classifier.Forward();
+    duration<double> forward_elapsed = high_resolution_clock::now() - start_time;
+
+    // Print the top N predictions for every image of the batch.
+    start_time = high_resolution_clock::now();
+    OutputView output = classifier.Output();
+    top_k_batch(output.data, output.num, output.channels, top_predictions.data());
+    if (!ground_truth.empty())
+      for (int i = 0; i < BATCH_SIZE; i++)
+        accuracy.Add(top_predictions[i], ground_truth[image_index + i]);
+    print_predictions(cout, classifier, &images[image_index], top_predictions.data(), BATCH_SIZE);
+    if (results.enabled())
+      write_predictions(results.json(), batch_index, &images[image_index], top_predictions.data(),
+                        ground_truth.empty() ? nullptr : &ground_truth[image_index], BATCH_SIZE);
+    duration<double> postprocess_elapsed = high_resolution_clock::now() - start_time;
 
-      image_index++;
+    if (measured) {
+      timer.RecordBatch(INPUT_STAGE, input_elapsed.count(), BATCH_SIZE);
+      timer.RecordBatch(FORWARD_STAGE, forward_elapsed.count(), BATCH_SIZE);
+      timer.RecordBatch(POSTPROCESS_STAGE, postprocess_elapsed.count(), BATCH_SIZE);
+      class_total_time += input_elapsed.count() + forward_elapsed.count();
+      images_processed += BATCH_SIZE;
     }
+
+    // Layer timings of warmup batches are excluded too
+    if (!measured)
+      classifier.ResetLayerTimings();
+    warmup.Add(input_elapsed.count() + forward_elapsed.count());
+
+    image_index += BATCH_SIZE;
+  }
+  duration<double> loop_elapsed = high_resolution_clock::now() - loop_start_time;
+
+  if (cache_writer) {
+    cache_writer->Close();
+    cout << endl << "Image cache updated, " << cache_writer->size() << " images" << endl;
   }
 
   double class_avg_time = class_total_time / double(images_processed);
 
   cout << endl;
   cout << "Images processed: " << images_processed << endl;
+  warmup.Print(cout);
+  cout << "Network reshapes: " << classifier.ReshapeCount() << endl;
   cout << "All images loaded in " << load_total_time << "s" << endl;
+  cout << "Waiting for loaded images took " << wait_total_time << "s" << endl;
   cout << "All images classified in " << class_total_time << "s" << endl;
-  cout << "Average classification time: " << class_avg_time << "s";
-  if (BATCH_COUNT > 1) cout << " (first batch excluded)";
+  cout << "Average classification time: " << class_avg_time << "s" << endl;
+  cout << "Classification throughput: " << 1.0 / class_avg_time << " images/s" << endl;
+  cout << "End-to-end throughput: " << IMAGES_COUNT / loop_elapsed.count() << " images/s" << endl;
+  print_accuracy(accuracy);
+
   cout << endl;
+  timer.Print(cout);
+  if (!TIMER_FILE.empty())
+    timer.WriteJson(TIMER_FILE);
+  if (results.enabled()) {
+    end_results(results.json(), timer, images_processed, warmup.Discarded(), class_avg_time,
+                1.0 / class_avg_time, IMAGES_COUNT / loop_elapsed.count(), accuracy);
+    results.Close();
+  }
+
+  if (LAYER_TIMING) {
+    cout << endl;
+    classifier.PrintLayerTimings(cout);
+    if (!LAYER_TIMING_FILE.empty())
+      classifier.WriteLayerTimingsJson(LAYER_TIMING_FILE);
+  }
 
   return 0;
 }
@@ -0,0 +1,78 @@
+#include "classifier.h"
+
+#include <algorithm>
+#include <fstream>
+
+Classifier::Classifier(const string& model_file,
+                       const string& trained_file,
+                       const string& mean_file,
+                       const string& label_file)
+  : CaffeRunner(model_file, trained_file) {
+  /* Load the binaryproto mean file. */
+  SetMean(mean_file, "");
+
+  /* Load labels. */
+  std::ifstream labels(label_file.c_str());
+  CHECK(labels) << "Unable to open labels file " << label_file;
+  string line;
+  while (std::getline(labels, line))
+    labels_.push_back(string(line));
+
+  Blob<float>* output_layer = net_->output_blobs()[0];
+  CHECK_EQ(labels_.size(), output_layer->channels())
+    << "Number of labels is different from the output layer dimension.";
+}
+
+Classifier::Classifier(const string& model_file,
+                       const Classifier& primary)
+  : CaffeRunner(model_file, primary),
+    labels_(primary.labels_) {
+}
+
+std::vector<float> Classifier::Predict(const cv::Mat& img) {
+  cv::Mat prepared = PrepareImage(img);
+  SetInput(&prepared, 1);
+  Forward();
+  OutputView output = Output();
+  return std::vector<float>(output.row(0), output.row(0) + output.channels);
+}
+
+std::vector<std::vector<float> > Classifier::PredictBatch(const std::vector<cv::Mat>& imgs) {
+  SetInput(imgs);
+  Forward();
+  return CopyOutput();
+}
+
+OutputView Classifier::PredictBatchView(const std::vector<cv::Mat>& imgs) {
+  SetInput(imgs);
+  Forward();
+  return Output();
+}
+
+/* Copy the output layer to a std::vector per image */
+std::vector<std::vector<float> > Classifier::CopyOutput() const {
+  OutputView output = Output();
+  std::vector<std::vector<float> > outputs;
+  outputs.reserve(output.num);
+  for (int i = 0; i < output.num; ++i)
+    outputs.push_back(std::vector<float>(output.row(i), output.row(i) + output.channels));
+  return outputs;
+}
+
+/* Return the top N predictions. */
+std::vector<Prediction> Classifier::ProcessPredictions(const std::vector<float>& output, int N) {
+  CHECK_LE(N, TOP_K) << "Only top " << TOP_K << " predictions can be selected.";
+  TopPredictions top;
+  top_k(output.data(), output.size(), &top);
+  N = std::min(top.count, N);
+  std::vector<Prediction> predictions;
+  for (int i = 0; i < N; ++i)
+    predictions.push_back(std::make_pair(labels_[top.index[i]], top.score[i]));
+
+  return predictions;
+}
+
+void Classifier::GetTopPredictions(TopPredictions* results) const {
+  OutputView output = Output();
+  top_k_batch(output.data, output.num, output.channels, results);
+}
@@ -0,0 +1,184 @@
+#ifndef IMAGE_PIPELINE_H
+#define IMAGE_PIPELINE_H
+
+#include <glog/logging.h>
+#include <opencv2/core/core.hpp>
+
+#include <algorithm>
+#include <chrono>
+#include <condition_variable>
+#include <functional>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <vector>
+
+/* Batch of images ready to be fed into the network. */
+struct PreparedBatch {
+  std::vector<cv::Mat> images;
+  // Decoding and preprocessing time of every image of the batch, s.
+  std::vector<double> decode_times;
+  std::vector<double> prepare_times;
+  // Number of images which are not prepared yet.
+  int pending = 0;
+};
+
+/* Bounded producer/consumer pipeline which decodes and prepares images
+ * ahead of the forward pass. A pool of workers fills a ring of `depth`
+ * batches, so at most `depth` batches are kept in memory and workers never
+ * run further ahead than that. Batches are handed out strictly in order.
+ * When there are no workers, batches are loaded by the consumer thread
+ * itself in Acquire(). */
+class ImagePipeline {
+public:
+  // Decodes an image file.
+  typedef std::function<cv::Mat(const std::string&)> DecodeFunc;
+
+  // Converts a decoded image to the network input format.
+  // Every image in the ring has its own slot index in range [0, depth*batch_size),
+  // so the function can keep the prepared image in preallocated memory of that slot.
+  typedef std::function<cv::Mat(const cv::Mat&, int slot)> PrepareFunc;
+
+  ImagePipeline(const std::vector<std::string>& files,
+                int batch_size,
+                int batch_count,
+                DecodeFunc decode,
+                PrepareFunc prepare,
+                int workers,
+                int depth);
+
+  ~ImagePipeline();
+
+  // Block until the batch is prepared. The batch stays valid until Release().
+  const PreparedBatch& Acquire(int batch_index);
+
+  // Return slot of the batch to the ring so workers can start filling it again.
+  void Release(int batch_index);
+
+private:
+  void WorkerLoop();
+
+  void LoadImage(int image_index, PreparedBatch& batch);
+
+  PreparedBatch& Slot(int batch_index) { return ring_[batch_index % ring_.size()]; }
+
+private:
+  const std::vector<std::string>& files_;
+  const int batch_size_;
+  const int images_count_;
+  DecodeFunc decode_;
+  PrepareFunc prepare_;
+
+  std::vector<PreparedBatch> ring_;
+  std::vector<std::thread> workers_;
+
+  std::mutex mutex_;
+  std::condition_variable batch_ready_;
+  std::condition_variable slot_released_;
+  int next_image_ = 0;
+  int released_batches_ = 0;
+  bool stop_ = false;
+};
+
+inline ImagePipeline::ImagePipeline(const std::vector<std::string>& files,
+                             int batch_size,
+                             int batch_count,
+                             DecodeFunc decode,
+                             PrepareFunc prepare,
+                             int workers,
+                             int depth)
+  : files_(files),
+    batch_size_(batch_size),
+    images_count_(batch_size * batch_count),
+    decode_(decode),
+    prepare_(prepare),
+    ring_(std::max(depth, 1)) {
+  CHECK_LE(images_count_, files_.size()) << "Not enough images for the requested batches.";
+
+  for (size_t i = 0; i < ring_.size(); ++i) {
+    ring_[i].images.resize(batch_size_);
+    ring_[i].decode_times.resize(batch_size_);
+    ring_[i].prepare_times.resize(batch_size_);
+    ring_[i].pending = batch_size_;
+  }
+  for (int i = 0; i < workers; ++i)
+    workers_.push_back(std::thread(&ImagePipeline::WorkerLoop, this));
+}
+
+inline ImagePipeline::~ImagePipeline() {
+  {
+    std::lock_guard<std::mutex> lock(mutex_);
+    stop_ = true;
+  }
+  slot_released_.notify_all();
+  for (size_t i = 0; i < workers_.size(); ++i)
+    workers_[i].join();
+}
+
+inline const PreparedBatch& ImagePipeline::Acquire(int batch_index) {
+  PreparedBatch& batch = Slot(batch_index);
+
+  if (workers_.empty()) {
+    for (int i = 0; i < batch_size_; ++i)
+      LoadImage(batch_index * batch_size_ + i, batch);
+    batch.pending = 0;
+    return batch;
+  }
+
+  std::unique_lock<std::mutex> lock(mutex_);
+  batch_ready_.wait(lock, [&batch] { return batch.pending == 0; });
+  return batch;
+}
+
+inline void ImagePipeline::Release(int batch_index) {
+  PreparedBatch& batch = Slot(batch_index);
+  {
+    std::lock_guard<std::mutex> lock(mutex_);
+    batch.pending = batch_size_;
+    released_batches_ = batch_index + 1;
+  }
+  slot_released_.notify_all();
+}
+
+inline void ImagePipeline::WorkerLoop() {
+  const int depth = ring_.size();
+  std::unique_lock<std::mutex> lock(mutex_);
+  while (true) {
+    /* Don't take an image of a batch whose slot is still held by the consumer. */
+    slot_released_.wait(lock, [this, depth] {
+      return stop_ || next_image_ >= images_count_ ||
+             next_image_ / batch_size_ < released_batches_ + depth;
+    });
+    if (stop_ || next_image_ >= images_count_)
+      return;
+
+    const int image_index = next_image_++;
+    PreparedBatch& batch = Slot(image_index / batch_size_);
+
+    lock.unlock();
+    LoadImage(image_index, batch);
+    lock.lock();
+
+    if (--batch.pending == 0)
+      batch_ready_.notify_all();
+  }
+}
+
+inline void ImagePipeline::LoadImage(int image_index, PreparedBatch& batch) {
+  using namespace std::chrono;
+  const int batch_index = image_index / batch_size_;
+  const int index_in_batch = image_index % batch_size_;
+  const int image_slot = (batch_index % ring_.size()) * batch_size_ + index_in_batch;
+
+  time_point<high_resolution_clock> start_time = high_resolution_clock::now();
+  cv::Mat img = decode_(files_[image_index]);
+  time_point<high_resolution_clock> decoded_time = high_resolution_clock::now();
+  batch.images[index_in_batch] = prepare_(img, image_slot);
+  duration<double> decode_elapsed = decoded_time - start_time;
+  duration<double> prepare_elapsed = high_resolution_clock::now() - decoded_time;
+
+  batch.decode_times[index_in_batch] = decode_elapsed.count();
+  batch.prepare_times[index_in_batch] = prepare_elapsed.count();
+}
+
+#endif // IMAGE_PIPELINE_H
@@ -0,0 +1,44 @@
+#ifndef AFFINITY_H
+#define AFFINITY_H
+
+#include <pthread.h>
+#include <sched.h>
+
+#include <algorithm>
+#include <thread>
+
+/* Helpers for running several network instances side by side: the thread
+ * of every instance is pinned to a disjoint set of cores. Worker threads
+ * of OpenBLAS are created when the library is loaded and are not pinned,
+ * so the instances only stay on their own cores when BLAS calls run in
+ * the calling thread, i.e. with 1 BLAS thread. */
+
+// OpenBLAS exports this, other BLAS libraries don't. Weak reference
+// lets the program link against any of them.
+extern "C" void openblas_set_num_threads(int threads) __attribute__((weak));
+
+inline int online_cores() {
+  return std::max(1u, std::thread::hardware_concurrency());
+}
+
+// Pin the calling thread to cores [first_core, first_core + cores).
+// Only threads created by it afterwards inherit the same affinity,
+// thread pools started earlier, like the one of OpenBLAS, keep theirs.
+inline bool pin_current_thread(int first_core, int cores) {
+  cpu_set_t set;
+  CPU_ZERO(&set);
+  for (int core = first_core; core < first_core + cores; ++core)
+    CPU_SET(core % CPU_SETSIZE, &set);
+  return pthread_setaffinity_np(pthread_self(), sizeof(set), &set) == 0;
+}
+
+// Number of threads BLAS uses for a single call, for the whole process.
+// Returns false when BLAS library doesn't allow to change it at run time.
+inline bool set_blas_threads(int threads) {
+  if (!openblas_set_num_threads)
+    return false;
+  openblas_set_num_threads(threads);
+  return true;
+}
+
+#endif // AFFINITY_H
@@ -0,0 +1,191 @@
+#ifndef CAFFE_DATUM_H
+#define CAFFE_DATUM_H
+
+#include <stdint.h>
+#include <string.h>
+
+#include <sstream>
+#include <stdexcept>
+#include <string>
+
+/* Caffe Datum protobuf message parsed without the Protobuf library.
+ * Image data is not copied, `data` or `float_data` point into the parsed
+ * buffer, e.g. into a memory mapped LMDB page.
+ * Read about binary protobuf format here:
+ * https://developers.google.com/protocol-buffers/docs/encoding */
+
+// Decode an unsigned varint of up to 10 bytes from [p, end) byte by byte.
+// Returns the number of bytes taken, or 0 if the varint is truncated
+// or doesn't fit into 64 bits.
+inline int decode_varint_bytewise(const uint8_t* p, const uint8_t* end, uint64_t* value) {
+  uint64_t result = 0;
+  for (int i = 0; i < 10 && p + i < end; i++) {
+    const uint64_t byte = p[i];
+    if (i == 9 && byte > 1)
+      return 0;
+    result |= (byte & 0x7F) << (7 * i);
+    if (!(byte & 0x80)) {
+      *value = result;
+      return i + 1;
+    }
+  }
+  return 0;
+}
+
+// Same as decode_varint_bytewise. When 8 bytes can be read, varints of up
+// to 8 bytes are decoded from a single unaligned 64-bit load: the first
+// byte with clear high bit ends the varint, bytes after it are masked out
+// and 7-bit groups are packed together in three steps of doubling width.
+inline int decode_varint(const uint8_t* p, const uint8_t* end, uint64_t* value) {
+#if defined(__GNUC__) && defined(__BYTE_ORDER__) && __BYTE_ORDER__ == __ORDER_LITTLE_ENDIAN__
+  if (end - p >= 8) {
+    uint64_t word;
+    memcpy(&word, p, sizeof(word));
+    const uint64_t stops = ~word & 0x8080808080808080ULL;
+    if (stops) {
+      // Bits up to the high bit of the last byte
+      uint64_t x = word & (stops ^ (stops - 1)) & 0x7F7F7F7F7F7F7F7FULL;
+      x = ((x & 0x7F007F007F007F00ULL) >> 1) | (x & 0x007F007F007F007FULL);
+      x = ((x & 0x3FFF00003FFF0000ULL) >> 2) | (x & 0x00003FFF00003FFFULL);
+      x = ((x & 0x0FFFFFFF00000000ULL) >> 4) | (x & 0x000000000FFFFFFFULL);
+      *value = x;
+      return (__builtin_ctzll(stops) + 1) / 8;
+    }
+  }
+#endif
+  return decode_varint_bytewise(p, end, value);
+}
+
+struct CaffeDatum {
+  int channels = 0;
+  int height = 0;
+  int width = 0;
+  const char* data = nullptr;
+  int label = 0;
+  bool encoded = false;
+  int image_bytes = 0;
+  // Packed float_data, e.g. a preprocessed tensor. Protobuf stores floats
+  // little-endian, so the view is valid on little-endian hosts only.
+  // The buffer doesn't guarantee alignment, read floats with memcpy.
+  const float* float_data = nullptr;
+  int float_count = 0;
+
+  enum {
+    TAG_CHANNELS = 1,
+    TAG_HEIGHT = 2,
+    TAG_WIDTH = 3,
+    TAG_DATA = 4,
+    TAG_LABEL = 5,
+    TAG_FLOAT_DATA = 6,
+    TAG_ENCODED = 7
+  };
+
+  enum {
+    WIRE_VARINT = 0,
+    WIRE_FIXED64 = 1,
+    WIRE_LENGTH_DELIMITED = 2,
+    WIRE_FIXED32 = 5
+  };
+
+  // Parse the message. Fields of unknown tags are skipped.
+  // Throws runtime_error if the message is malformed.
+  void parse(const char* buf, int size) {
+    const uint8_t* p = reinterpret_cast<const uint8_t*>(buf);
+    const uint8_t* end = p + size;
+    while (p < end) {
+      uint64_t key, value;
+      p = read_varint(buf, p, end, &key);
+      const int tag = int(key >> 3);
+      switch (int(key & 0x7)) {
+      case WIRE_VARINT:
+        p = read_varint(buf, p, end, &value);
+        // int32 fields are sign-extended to 64 bits, truncation restores them
+        switch (tag) {
+        case TAG_CHANNELS: channels = int32_t(value); break;
+        case TAG_HEIGHT: height = int32_t(value); break;
+        case TAG_WIDTH: width = int32_t(value); break;
+        case TAG_LABEL: label = int32_t(value); break;
+        case TAG_ENCODED: encoded = value != 0; break;
+        }
+        break;
+
+      case WIRE_LENGTH_DELIMITED:
+        p = read_varint(buf, p, end, &value);
+        if (value > uint64_t(end - p))
+          error("Field is out of message", buf, p);
+        if (tag == TAG_DATA) {
+          data = reinterpret_cast<const char*>(p);
+          image_bytes = int(value);
+        }
+        else if (tag == TAG_FLOAT_DATA) {
+          if (float_data)
+            error("float_data split into several fields is not supported", buf, p);
+          if (value % sizeof(float))
+            error("Packed float_data size is not a multiple of float size", buf, p);
+          float_data = reinterpret_cast<const float*>(p);
+          float_count = int(value / sizeof(float));
+        }
+        p += value;
+        break;
+
+      case WIRE_FIXED64:
+        if (end - p < 8)
+          error("Truncated fixed64 field", buf, p);
+        p += 8;
+        break;
+
+      case WIRE_FIXED32:
+        // Floats written one by one can't be viewed without a copy
+        if (tag == TAG_FLOAT_DATA)
+          error("Unpacked float_data is not supported", buf, p);
+        if (end - p < 4)
+          error("Truncated fixed32 field", buf, p);
+        p += 4;
+        break;
+
+      default:
+        // Groups are deprecated and never used in Datum
+        error("Unsupported wire type", buf, p);
+      }
+    }
+  }
+
+  std::string verify() const {
+    std::ostringstream s;
+    if (channels == 0) s << " Field is not assigned: channels.";
+    if (height == 0) s << " Field is not assigned: height.";
+    if (width == 0) s << " Field is not assigned: width.";
+    if (data == nullptr && float_data == nullptr) s << " Field is not assigned: data.";
+    if (label == 0) s << " Field is not assigned: label.";
+    if (image_bytes == 0 && float_data == nullptr) s << " Field is not assigned: image_bytes.";
+    if (float_data && float_count != channels * height * width) s << " Size of float_data doesn't match CHW.";
+    return s.str();
+  }
+
+  std::string str() const {
+    std::ostringstream s;
+    s << "CHW: " << channels << "*" << height << "*" << width << ", "
+      << "Bytes: " << image_bytes << ", "
+      << "Floats: " << float_count << ", "
+      << "Label: " << label << ", "
+      << "Encoded: " << (encoded ? "true": "false")
+      << ".";
+    return s.str();
+  }
+
+private:
+  static const uint8_t* read_varint(const char* buf, const uint8_t* p, const uint8_t* end, uint64_t* value) {
+    const int bytes = decode_varint(p, end, value);
+    if (!bytes)
+      error("Malformed varint", buf, p);
+    return p + bytes;
+  }
+
+  [[noreturn]] static void error(const char* what, const char* buf, const uint8_t* p) {
+    std::ostringstream s;
+    s << what << " at offset " << (reinterpret_cast<const char*>(p) - buf);
+    throw std::runtime_error(s.str());
+  }
+};
+
+#endif // CAFFE_DATUM_H
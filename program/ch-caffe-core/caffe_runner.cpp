@@ -0,0 +1,338 @@
+#include "caffe_runner.h"
+#include "json_writer.h"
+#include "preprocess.h"
+
+#include <opencv2/imgproc/imgproc.hpp>
+
+#include <algorithm>
+#include <chrono>
+#include <iomanip>
+#include <map>
+#include <sstream>
+
+#include <string.h>
+
+using namespace caffe;
+using std::string;
+
+CaffeRunner::CaffeRunner(const string& model_file,
+                         const string& weights_file) {
+  LoadNet(model_file);
+  net_->CopyTrainedLayersFrom(weights_file);
+}
+
+CaffeRunner::CaffeRunner(const string& model_file,
+                         const CaffeRunner& primary) {
+  LoadNet(model_file);
+
+  /* Parameter blobs of every layer start pointing to the memory of the
+   * layer with the same name in the primary net instead of own copies. */
+  net_->ShareTrainedLayersWith(primary.net_.get());
+
+  CHECK(input_geometry_ == primary.input_geometry_ && num_channels_ == primary.num_channels_)
+    << "Network input doesn't match the primary network.";
+  mean_ = primary.mean_;
+}
+
+void CaffeRunner::LoadNet(const string& model_file) {
+#ifdef CPU_ONLY
+  Caffe::set_mode(Caffe::CPU);
+#else
+  Caffe::set_mode(Caffe::GPU);
+#endif
+
+  /* Load the network. */
+  net_.reset(new Net<float>(model_file, TEST));
+
+  CHECK_EQ(net_->num_inputs(), 1) << "Network should have exactly one input.";
+  CHECK_EQ(net_->num_outputs(), 1) << "Network should have exactly one output.";
+
+  Blob<float>* input_layer = net_->input_blobs()[0];
+  num_channels_ = input_layer->channels();
+  CHECK(num_channels_ == 3 || num_channels_ == 1)
+    << "Input layer should have 1 or 3 channels.";
+  input_geometry_ = cv::Size(input_layer->width(), input_layer->height());
+
+  /* One preprocessing slot for every image of the batch. */
+  ReservePrepareSlots(input_layer->num());
+}
+
+/* Load the mean file in binaryproto format or parse mean values. */
+void CaffeRunner::SetMean(const string& mean_file, const string& mean_value) {
+  if (!mean_file.empty()) {
+    CHECK(mean_value.empty()) <<
+      "Cannot specify mean_file and mean_value at the same time";
+    BlobProto blob_proto;
+    ReadProtoFromBinaryFileOrDie(mean_file.c_str(), &blob_proto);
+
+    /* Convert from BlobProto to Blob<float> */
+    Blob<float> mean_blob;
+    mean_blob.FromProto(blob_proto);
+    CHECK_EQ(mean_blob.channels(), num_channels_)
+      << "Number of channels of mean file doesn't match input layer.";
+
+    /* The format of the mean file is planar 32-bit float BGR or grayscale. */
+    std::vector<cv::Mat> channels;
+    float* data = mean_blob.mutable_cpu_data();
+    for (int i = 0; i < num_channels_; ++i) {
+      /* Extract an individual channel. */
+      cv::Mat channel(mean_blob.height(), mean_blob.width(), CV_32FC1, data);
+      channels.push_back(channel);
+      data += mean_blob.height() * mean_blob.width();
+    }
+
+    /* Merge the separate channels into a single image. */
+    cv::Mat mean;
+    cv::merge(channels, mean);
+
+    /* Compute the global mean pixel value of every channel. */
+    cv::Scalar channel_mean = cv::mean(mean);
+    mean_.assign(channel_mean.val, channel_mean.val + num_channels_);
+  }
+  if (!mean_value.empty()) {
+    CHECK(mean_file.empty()) <<
+      "Cannot specify mean_file and mean_value at the same time";
+    std::stringstream ss(mean_value);
+    std::vector<float> values;
+    string item;
+    while (getline(ss, item, ',')) {
+      float value = std::atof(item.c_str());
+      values.push_back(value);
+    }
+    CHECK(values.size() == 1 || values.size() == num_channels_) <<
+      "Specify either 1 mean_value or as many as channels: " << num_channels_;
+
+    /* A single value is used for all channels. */
+    mean_.resize(num_channels_);
+    for (int i = 0; i < num_channels_; ++i)
+      mean_[i] = values[values.size() == 1 ? 0 : i];
+  }
+}
+
+/* Resize the input image to the input geometry of the network. Channel
+ * conversion, mean subtraction and conversion to float are postponed to
+ * FillInputChannels, which does them in one pass without intermediate
+ * images. Resizing before channel conversion also means that channels
+ * are converted for the small image only. */
+cv::Mat CaffeRunner::PrepareImage(const cv::Mat& img, int slot) {
+  CHECK(img.depth() == CV_8U) << "Only 8-bit images are supported.";
+  CHECK(img.channels() == 1 || img.channels() == 3 || img.channels() == 4)
+    << "Image should have 1, 3 or 4 channels.";
+
+  if (img.size() == input_geometry_)
+    return img;
+
+  /* Resized image has the same type as the arena slot header,
+   * so cv::resize writes into the arena instead of allocating. */
+  cv::Mat sample_resized = arena_.Slot(slot, img.channels());
+  uchar* arena_data = sample_resized.data;
+  cv::resize(img, sample_resized, input_geometry_);
+  CHECK(sample_resized.data == arena_data) << "Resized image is not stored in the arena.";
+  return sample_resized;
+}
+
+void CaffeRunner::SetInput(const cv::Mat* imgs, int count) {
+  CHECK_GT(count, 0) << "Batch should contain at least one image.";
+
+  ReshapeInput(count);
+  WrapInputLayer();
+
+  /* Every image owns its own group of num_channels_ planes in the batch. */
+  for (int i = 0; i < count; ++i)
+    FillInputChannels(imgs[i], &input_planes_[i * num_channels_]);
+  CHECK(input_planes_[0] == net_->input_blobs()[0]->cpu_data())
+    << "Input planes are not pointing to the input layer of the network.";
+}
+
+void CaffeRunner::SetInputTensors(const float* const* tensors, int count) {
+  CHECK_GT(count, 0) << "Batch should contain at least one image.";
+
+  ReshapeInput(count);
+  Blob<float>* input_layer = net_->input_blobs()[0];
+  const size_t tensor_size = input_layer->count() / count;
+  float* input_data = input_layer->mutable_cpu_data();
+  for (int i = 0; i < count; ++i)
+    memcpy(input_data + i * tensor_size, tensors[i], tensor_size * sizeof(float));
+}
+
+void CaffeRunner::SetInputDatums(const CaffeDatum* const* datums, int count) {
+  /* Tensors are copied from the records by SetInputTensors with memcpy,
+   * which doesn't need float_data to be aligned. */
+  datum_tensors_.resize(count);
+  for (int i = 0; i < count; ++i) {
+    const CaffeDatum& datum = *datums[i];
+    CHECK(datum.float_data) << "Datum doesn't contain float_data.";
+    CHECK(datum.channels == num_channels_ &&
+          datum.height == input_geometry_.height &&
+          datum.width == input_geometry_.width)
+      << "Datum geometry " << datum.channels << "x" << datum.height << "x" << datum.width
+      << " doesn't match the input layer.";
+    CHECK_EQ(datum.float_count, num_channels_ * input_geometry_.area())
+      << "Size of float_data doesn't match Datum geometry.";
+    datum_tensors_[i] = datum.float_data;
+  }
+  SetInputTensors(datum_tensors_.data(), count);
+}
+
+const float* CaffeRunner::InputTensor(int image) const {
+  Blob<float>* input_layer = net_->input_blobs()[0];
+  return input_layer->cpu_data() + image * (input_layer->count() / input_layer->num());
+}
+
+void CaffeRunner::Forward() {
+  if (!layer_timing_) {
+    net_->Forward();
+    return;
+  }
+
+  /* Net::Forward() is the same as ForwardFromTo() over all the layers. */
+  const int num_layers = net_->layers().size();
+  layer_times_.resize(num_layers);
+  for (int i = 0; i < num_layers; ++i) {
+    auto start_time = std::chrono::high_resolution_clock::now();
+    net_->ForwardFromTo(i, i);
+    std::chrono::duration<double> elapsed = std::chrono::high_resolution_clock::now() - start_time;
+    layer_times_[i] += elapsed.count();
+  }
+  layer_timing_runs_++;
+}
+
+OutputView CaffeRunner::Output() const {
+  Blob<float>* output_layer = net_->output_blobs()[0];
+  OutputView output;
+  output.data = output_layer->cpu_data();
+  output.num = output_layer->num();
+  output.channels = output_layer->count() / std::max(output_layer->num(), 1);
+  return output;
+}
+
+void CaffeRunner::ResetLayerTimings() {
+  layer_times_.assign(layer_times_.size(), 0);
+  layer_timing_runs_ = 0;
+}
+
+/* Print accumulated layer times sorted from the slowest layer,
+ * followed by times summed over layers of the same type. */
+void CaffeRunner::PrintLayerTimings(std::ostream& out) const {
+  double total_time = 0;
+  std::vector<int> order;
+  std::map<string, double> type_times;
+  for (size_t i = 0; i < layer_times_.size(); ++i) {
+    total_time += layer_times_[i];
+    order.push_back(i);
+    type_times[net_->layers()[i]->type()] += layer_times_[i];
+  }
+  std::sort(order.begin(), order.end(), [this](int a, int b) {
+    return layer_times_[a] > layer_times_[b];
+  });
+  const int runs = std::max(layer_timing_runs_, 1);
+  /* Nothing is timed when all batches were discarded as warmup. */
+  const double percent = total_time > 0 ? 100 / total_time : 0;
+
+  std::ios::fmtflags flags = out.flags();
+  out << std::fixed << std::setprecision(3);
+  out << "Layer timings over " << layer_timing_runs_ << " forward passes, ms:" << std::endl;
+  out << std::left << std::setw(32) << "  layer" << std::setw(20) << "type" << std::right
+      << std::setw(12) << "total" << std::setw(12) << "per pass" << std::setw(8) << "%" << std::endl;
+  for (size_t i = 0; i < order.size(); ++i) {
+    const int layer = order[i];
+    out << "  " << std::left << std::setw(30) << net_->layer_names()[layer]
+        << std::setw(20) << net_->layers()[layer]->type() << std::right
+        << std::setw(12) << layer_times_[layer] * 1000
+        << std::setw(12) << layer_times_[layer] * 1000 / runs
+        << std::setw(8) << std::setprecision(1) << layer_times_[layer] * percent
+        << std::setprecision(3) << std::endl;
+  }
+  out << "Layer types, ms:" << std::endl;
+  for (std::map<string, double>::const_iterator it = type_times.begin(); it != type_times.end(); ++it) {
+    out << "  " << std::left << std::setw(50) << it->first << std::right
+        << std::setw(12) << it->second * 1000
+        << std::setw(12) << it->second * 1000 / runs
+        << std::setw(8) << std::setprecision(1) << it->second * percent
+        << std::setprecision(3) << std::endl;
+  }
+  out.flags(flags);
+}
+
+void CaffeRunner::WriteLayerTimingsJson(const string& file_name) const {
+  const int runs = std::max(layer_timing_runs_, 1);
+  std::map<string, double> type_times;
+  JsonFile file(file_name);
+  if (!file.enabled())
+    return;
+  JsonWriter& json = file.json();
+  json.BeginObject()
+      .Field("forward_passes", layer_timing_runs_)
+      .Key("layers_ms").BeginArray();
+  for (size_t i = 0; i < layer_times_.size(); ++i) {
+    const string type = net_->layers()[i]->type();
+    type_times[type] += layer_times_[i];
+    json.BeginObject()
+        .Field("name", net_->layer_names()[i])
+        .Field("type", type)
+        .Field("total", layer_times_[i] * 1000)
+        .Field("per_pass", layer_times_[i] * 1000 / runs)
+        .EndObject();
+  }
+  json.EndArray().Key("types_ms").BeginObject();
+  for (std::map<string, double>::const_iterator it = type_times.begin(); it != type_times.end(); ++it) {
+    json.Key(it->first.c_str()).BeginObject()
+        .Field("total", it->second * 1000)
+        .Field("per_pass", it->second * 1000 / runs)
+        .EndObject();
+  }
+  json.EndObject().EndObject();
+  file.Close();
+}
+
+/* Reshape the input layer for the given number of images. Net::Reshape()
+ * walks through all the layers, so it is only done when the shape of the
+ * input actually changes, e.g. for the first or the last incomplete batch. */
+void CaffeRunner::ReshapeInput(int batch_size) {
+  Blob<float>* input_layer = net_->input_blobs()[0];
+  if (input_layer->num() == batch_size &&
+      input_layer->channels() == num_channels_ &&
+      input_layer->height() == input_geometry_.height &&
+      input_layer->width() == input_geometry_.width)
+    return;
+
+  input_layer->Reshape(batch_size, num_channels_,
+                       input_geometry_.height, input_geometry_.width);
+  /* Forward dimension change to all layers. */
+  net_->Reshape();
+  reshape_count_++;
+}
+
+/* Keep pointers to separate planes of the input layer of the network
+ * (one per channel of every image in the batch). This way we save one
+ * memcpy operation and we don't need to rely on cudaMemcpy2D. The last
+ * preprocessing operation will write the separate channels directly
+ * to the input layer. Pointers are only rebuilt when the input layer
+ * has been reshaped or reallocated since the previous call. */
+void CaffeRunner::WrapInputLayer() {
+  Blob<float>* input_layer = net_->input_blobs()[0];
+
+  int plane_size = input_layer->width() * input_layer->height();
+  int planes = input_layer->num() * input_layer->channels();
+  float* input_data = input_layer->mutable_cpu_data();
+  if (input_data == wrapped_input_ && planes == int(input_planes_.size()) &&
+      (planes < 2 || input_planes_[1] - input_planes_[0] == plane_size))
+    return;
+
+  input_planes_.clear();
+  wrapped_input_ = input_data;
+  for (int i = 0; i < planes; ++i) {
+    input_planes_.push_back(input_data);
+    input_data += plane_size;
+  }
+}
+
+/* This operation will write the separate BGR planes directly to the
+ * input layer of the network because planes point into its memory. */
+void CaffeRunner::FillInputChannels(const cv::Mat& img, float* const* planes) {
+  CHECK(img.depth() == CV_8U && img.size() == input_geometry_)
+    << "Image is not prepared for the network.";
+
+  preprocess_image(img.ptr<uint8_t>(), img.step, img.cols, img.rows, img.channels(),
+                   mean_.data(), planes, num_channels_);
+}
@@ -0,0 +1,122 @@
+#ifndef CAFFE_RUNNER_H
+#define CAFFE_RUNNER_H
+
+#include <caffe/caffe.hpp>
+
+#include <opencv2/core/core.hpp>
+
+#include "caffe_datum.h"
+#include "image_arena.h"
+
+#include <ostream>
+#include <string>
+#include <vector>
+
+/* Read-only view over the output layer of the network, one row of
+ * values per image. It points into memory of the network, so it
+ * stays valid only until the next forward pass or reshape. */
+struct OutputView {
+  const float* data = nullptr;
+  int num = 0;
+  int channels = 0;
+
+  const float* row(int image) const { return data + image * channels; }
+};
+
+/* Network with a single input and a single output, fed with 8-bit images.
+ * Owns everything which doesn't depend on what the network computes:
+ * loading, preparing images for the input geometry, writing batches
+ * of images into the input layer, running and timing the forward pass.
+ * Programs wrap it into a class interpreting the output layer. */
+class CaffeRunner {
+public:
+  CaffeRunner(const std::string& model_file,
+              const std::string& weights_file);
+
+  // Network sharing trained parameters and the mean with the primary one,
+  // only activations are allocated. Primary should outlive this runner.
+  // Both can run forward passes concurrently, parameters are only read.
+  CaffeRunner(const std::string& model_file,
+              const CaffeRunner& primary);
+
+  virtual ~CaffeRunner() {}
+
+  // Resize the input image to the input geometry of the network.
+  // The rest of preprocessing is done when the image is fed into the network.
+  // Resized image is stored in the given slot of preprocessing arena
+  // and stays valid until the slot is used again.
+  cv::Mat PrepareImage(const cv::Mat& img, int slot = 0);
+
+  // Make sure the preprocessing arena has at least `count` slots.
+  // Should be called before images are prepared concurrently.
+  void ReservePrepareSlots(int count) { arena_.Reserve(input_geometry_, count); }
+
+  // Write prepared images into the input layer of the network,
+  // reshaping it for the number of images when needed.
+  void SetInput(const std::vector<cv::Mat>& imgs) { SetInput(imgs.data(), imgs.size()); }
+  void SetInput(const cv::Mat* imgs, int count);
+
+  // Write already preprocessed images, planar float tensors of
+  // NumChannels() * height * width values, into the input layer.
+  void SetInputTensors(const float* const* tensors, int count);
+
+  // Write float_data of Datum records, e.g. read from LMDB, straight into
+  // the input layer. Records should hold tensors of the input geometry,
+  // preprocessed the same way as by PrepareImage and SetInput.
+  void SetInputDatums(const CaffeDatum* const* datums, int count);
+
+  // Preprocessed tensor of an image of the last SetInput().
+  const float* InputTensor(int image) const;
+
+  // Run the forward pass for the images of the last SetInput().
+  void Forward();
+
+  // View of the output layer, valid until the next forward pass.
+  OutputView Output() const;
+
+  cv::Size InputGeometry() const { return input_geometry_; }
+  int NumChannels() const { return num_channels_; }
+  const std::vector<float>& Mean() const { return mean_; }
+
+  // How many times the network has been reshaped since construction.
+  int ReshapeCount() const { return reshape_count_; }
+
+  // When enabled, Forward() runs the network layer by layer and
+  // accumulates wall time spent in every layer.
+  void EnableLayerTiming(bool enable) { layer_timing_ = enable; }
+  void ResetLayerTimings();
+  void PrintLayerTimings(std::ostream& out) const;
+  void WriteLayerTimingsJson(const std::string& file_name) const;
+
+protected:
+  // Per-channel mean, either averaged over a binaryproto mean file
+  // or given as comma separated values (one value for all channels).
+  void SetMean(const std::string& mean_file, const std::string& mean_value);
+
+protected:
+  caffe::shared_ptr<caffe::Net<float> > net_;
+  cv::Size input_geometry_;
+  int num_channels_;
+  std::vector<float> mean_;
+
+private:
+  void LoadNet(const std::string& model_file);
+
+  void ReshapeInput(int batch_size);
+
+  void WrapInputLayer();
+
+  void FillInputChannels(const cv::Mat& img, float* const* planes);
+
+private:
+  ImageArena arena_;
+  std::vector<float*> input_planes_;
+  std::vector<const float*> datum_tensors_;
+  const float* wrapped_input_ = nullptr;
+  int reshape_count_ = 0;
+  bool layer_timing_ = false;
+  std::vector<double> layer_times_;
+  int layer_timing_runs_ = 0;
+};
+
+#endif // CAFFE_RUNNER_H
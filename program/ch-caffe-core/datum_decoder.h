@@ -0,0 +1,155 @@
+#ifndef DATUM_DECODER_H
+#define DATUM_DECODER_H
+
+#include "lmdb_reader.h"
+
+#include <opencv2/core/core.hpp>
+#include <opencv2/imgcodecs/imgcodecs.hpp>
+
+#include <stdint.h>
+
+#include <algorithm>
+#include <condition_variable>
+#include <functional>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+/* Decoding of images of Datum records into BGR (or grayscale) 8-bit
+ * images of OpenCV. Encoded records are decoded with cv::imdecode right
+ * from the bytes of the record, e.g. from a memory mapped LMDB page,
+ * without a temporary copy. Raw records hold planar CHW images, they
+ * are interleaved into a new image. Returns an empty image when the
+ * record can't be decoded. */
+inline cv::Mat decode_datum(const CaffeDatum& datum, int flags = cv::IMREAD_COLOR) {
+  if (!datum.data || datum.image_bytes <= 0)
+    return cv::Mat();
+  if (datum.encoded) {
+    // imdecode only reads the buffer
+    cv::Mat buffer(1, datum.image_bytes, CV_8UC1, const_cast<char*>(datum.data));
+    try {
+      return cv::imdecode(buffer, flags);
+    }
+    catch (const cv::Exception&) {
+      return cv::Mat();
+    }
+  }
+  const int plane = datum.height * datum.width;
+  if (datum.channels <= 0 || datum.channels > 4 || plane <= 0 ||
+      datum.image_bytes != datum.channels * plane)
+    return cv::Mat();
+  cv::Mat img(datum.height, datum.width, CV_8UC(datum.channels));
+  const uint8_t* src = reinterpret_cast<const uint8_t*>(datum.data);
+  for (int c = 0; c < datum.channels; ++c) {
+    uint8_t* dst = img.ptr<uint8_t>() + c;
+    for (int i = 0; i < plane; ++i)
+      dst[i * datum.channels] = src[c * plane + i];
+  }
+  return img;
+}
+
+/* Decodes records with a pool of worker threads and hands decoded images
+ * to the consumer in the order records were submitted, i.e. in key order
+ * when they come from an LMDB iterator. Records are submitted and images
+ * consumed in the calling thread: when `depth` records are in flight,
+ * Submit() waits for the oldest one and passes it to the consumer.
+ * Records should stay valid until they are consumed, records of an LMDB
+ * iterator do while the transaction is open. Without workers records are
+ * decoded in the calling thread as they are submitted. */
+class OrderedDatumDecoder {
+public:
+  typedef std::function<void(int64_t index, const LmdbRecord& record, const cv::Mat& image)> Consumer;
+
+  OrderedDatumDecoder(int workers, int depth, const Consumer& consume, int flags = cv::IMREAD_COLOR)
+    : consume_(consume), flags_(flags), slots_(std::max(depth, 1)) {
+    for (int i = 0; i < workers; i++)
+      threads_.push_back(std::thread(&OrderedDatumDecoder::Work, this));
+  }
+
+  ~OrderedDatumDecoder() {
+    {
+      std::lock_guard<std::mutex> lock(mutex_);
+      stop_ = true;
+    }
+    work_cond_.notify_all();
+    for (size_t i = 0; i < threads_.size(); i++)
+      threads_[i].join();
+  }
+
+  OrderedDatumDecoder(const OrderedDatumDecoder&) = delete;
+  OrderedDatumDecoder& operator=(const OrderedDatumDecoder&) = delete;
+
+  void Submit(const LmdbRecord& record) {
+    if (submitted_ - consumed_ == int64_t(slots_.size()))
+      ConsumeOldest();
+    {
+      std::lock_guard<std::mutex> lock(mutex_);
+      Slot& slot = slots_[submitted_ % slots_.size()];
+      slot.record = record;
+      slot.ready = threads_.empty();
+      if (slot.ready)
+        slot.image = decode_datum(slot.record.datum, flags_);
+      submitted_++;
+    }
+    work_cond_.notify_one();
+  }
+
+  // Wait for all submitted records and consume them.
+  void Finish() {
+    while (consumed_ < submitted_)
+      ConsumeOldest();
+  }
+
+private:
+  struct Slot {
+    LmdbRecord record;
+    cv::Mat image;
+    bool ready = false;
+  };
+
+  void ConsumeOldest() {
+    Slot& slot = slots_[consumed_ % slots_.size()];
+    {
+      std::unique_lock<std::mutex> lock(mutex_);
+      done_cond_.wait(lock, [&slot] { return slot.ready; });
+    }
+    consume_(consumed_, slot.record, slot.image);
+    consumed_++;
+  }
+
+  void Work() {
+    for (;;) {
+      Slot* slot;
+      {
+        std::unique_lock<std::mutex> lock(mutex_);
+        work_cond_.wait(lock, [this] { return stop_ || next_ < submitted_; });
+        if (next_ >= submitted_)
+          return;
+        slot = &slots_[next_++ % slots_.size()];
+      }
+      // The slot is not touched by others until it's ready
+      slot->image = decode_datum(slot->record.datum, flags_);
+      {
+        std::lock_guard<std::mutex> lock(mutex_);
+        slot->ready = true;
+      }
+      done_cond_.notify_all();
+    }
+  }
+
+private:
+  Consumer consume_;
+  const int flags_;
+  std::vector<Slot> slots_;
+  std::vector<std::thread> threads_;
+  std::mutex mutex_;
+  std::condition_variable work_cond_;
+  std::condition_variable done_cond_;
+  // Records submitted, taken by workers and consumed since construction
+  int64_t submitted_ = 0;
+  int64_t next_ = 0;
+  int64_t consumed_ = 0;
+  bool stop_ = false;
+};
+
+#endif // DATUM_DECODER_H
@@ -0,0 +1,56 @@
+#ifndef IMAGE_ARENA_H
+#define IMAGE_ARENA_H
+
+#include <glog/logging.h>
+#include <opencv2/core/core.hpp>
+
+#include <stdint.h>
+#include <vector>
+
+/* Reusable memory for 8-bit images of fixed geometry, e.g. images resized
+ * to the network input size. Memory is allocated once for a number of slots,
+ * every slot starts at a cache line boundary and can hold an image with up
+ * to 4 channels. Images are cv::Mat headers over slot memory, so OpenCV
+ * functions writing into them (like cv::resize) don't allocate. */
+class ImageArena {
+public:
+  static const size_t CACHE_LINE = 64;
+  static const int MAX_CHANNELS = 4;
+
+  // Make sure there are at least `slots` slots for images of given geometry.
+  // Images previously returned by Slot() are invalidated if memory grows.
+  void Reserve(cv::Size geometry, int slots);
+
+  // Image header over memory of the slot.
+  cv::Mat Slot(int index, int channels);
+
+  int slots() const { return slots_; }
+
+private:
+  std::vector<uint8_t> memory_;
+  uint8_t* aligned_ = nullptr;
+  cv::Size geometry_;
+  size_t slot_bytes_ = 0;
+  int slots_ = 0;
+};
+
+inline void ImageArena::Reserve(cv::Size geometry, int slots) {
+  if (geometry == geometry_ && slots <= slots_)
+    return;
+
+  size_t image_bytes = size_t(geometry.width) * geometry.height * MAX_CHANNELS;
+  slot_bytes_ = (image_bytes + CACHE_LINE - 1) / CACHE_LINE * CACHE_LINE;
+  memory_.resize(slot_bytes_ * slots + CACHE_LINE);
+  uintptr_t begin = reinterpret_cast<uintptr_t>(memory_.data());
+  aligned_ = reinterpret_cast<uint8_t*>((begin + CACHE_LINE - 1) / CACHE_LINE * CACHE_LINE);
+  geometry_ = geometry;
+  slots_ = slots;
+}
+
+inline cv::Mat ImageArena::Slot(int index, int channels) {
+  CHECK(index >= 0 && index < slots_) << "Arena slot " << index << " is not reserved.";
+  CHECK(channels > 0 && channels <= MAX_CHANNELS) << "Unsupported number of channels: " << channels;
+  return cv::Mat(geometry_.height, geometry_.width, CV_8UC(channels), aligned_ + slot_bytes_ * index);
+}
+
+#endif // IMAGE_ARENA_H
@@ -0,0 +1,157 @@
+#include "image_cache.h"
+
+#include <glog/logging.h>
+
+#include <fcntl.h>
+#include <stdio.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+static const char CACHE_MAGIC[8] = { 'C', 'K', 'I', 'M', 'G', 'C', '0', '2' };
+static const size_t CACHE_ALIGN = 64;
+
+static size_t align_up(size_t value) {
+  return (value + CACHE_ALIGN - 1) / CACHE_ALIGN * CACHE_ALIGN;
+}
+
+static void fill_header(ImageCacheHeader* header, cv::Size geometry, int channels,
+                        const std::vector<float>& mean, cv::Size reduced) {
+  memset(header, 0, sizeof(ImageCacheHeader));
+  memcpy(header->magic, CACHE_MAGIC, sizeof(CACHE_MAGIC));
+  header->width = geometry.width;
+  header->height = geometry.height;
+  header->channels = channels;
+  for (int i = 0; i < channels && i < 4; ++i)
+    header->mean[i] = mean[i];
+  header->reduced_width = reduced.width;
+  header->reduced_height = reduced.height;
+  header->data_offset = align_up(sizeof(ImageCacheHeader));
+  header->tensor_bytes = align_up(size_t(channels) * geometry.width * geometry.height * sizeof(float));
+}
+
+ImageCache::~ImageCache() {
+  Close();
+}
+
+void ImageCache::Close() {
+  if (data_)
+    munmap(const_cast<uint8_t*>(data_), size_);
+  data_ = nullptr;
+  header_ = nullptr;
+  size_ = 0;
+  paths_.clear();
+  index_.clear();
+}
+
+bool ImageCache::Open(const std::string& file_name, cv::Size geometry, int channels,
+                      const std::vector<float>& mean, cv::Size reduced) {
+  Close();
+
+  int fd = open(file_name.c_str(), O_RDONLY);
+  if (fd < 0)
+    return false;
+  struct stat st;
+  if (fstat(fd, &st) != 0 || size_t(st.st_size) < sizeof(ImageCacheHeader)) {
+    close(fd);
+    return false;
+  }
+  void* data = mmap(nullptr, st.st_size, PROT_READ, MAP_SHARED, fd, 0);
+  close(fd);
+  if (data == MAP_FAILED)
+    return false;
+  data_ = static_cast<const uint8_t*>(data);
+  size_ = st.st_size;
+  header_ = reinterpret_cast<const ImageCacheHeader*>(data_);
+
+  /* Only a cache of the same input format can be used. */
+  ImageCacheHeader expected;
+  fill_header(&expected, geometry, channels, mean, reduced);
+  if (memcmp(header_->magic, expected.magic, sizeof(expected.magic)) != 0 ||
+      header_->width != expected.width || header_->height != expected.height ||
+      header_->channels != expected.channels ||
+      memcmp(header_->mean, expected.mean, sizeof(expected.mean)) != 0 ||
+      header_->reduced_width != expected.reduced_width ||
+      header_->reduced_height != expected.reduced_height ||
+      header_->data_offset != expected.data_offset ||
+      header_->tensor_bytes != expected.tensor_bytes ||
+      header_->index_offset != header_->data_offset + header_->images * header_->tensor_bytes ||
+      header_->index_offset > size_) {
+    LOG(WARNING) << "Image cache " << file_name << " doesn't match the network input, ignored";
+    Close();
+    return false;
+  }
+
+  /* Index is a list of (uint32 length, path bytes) records. */
+  const uint8_t* p = data_ + header_->index_offset;
+  const uint8_t* end = data_ + size_;
+  paths_.reserve(header_->images);
+  for (uint32_t i = 0; i < header_->images; ++i) {
+    uint32_t len;
+    if (size_t(end - p) < sizeof(len))
+      break;
+    memcpy(&len, p, sizeof(len));
+    p += sizeof(len);
+    if (end - p < len)
+      break;
+    paths_.push_back(std::string(reinterpret_cast<const char*>(p), len));
+    index_[paths_.back()] = i;
+    p += len;
+  }
+  if (paths_.size() != header_->images) {
+    LOG(WARNING) << "Image cache " << file_name << " is truncated, ignored";
+    Close();
+    return false;
+  }
+
+  /* Tensors are read in order of adding, as they were written. */
+  madvise(const_cast<uint8_t*>(data_), size_, MADV_WILLNEED);
+  return true;
+}
+
+const float* ImageCache::Tensor(int index) const {
+  return reinterpret_cast<const float*>(data_ + header_->data_offset + index * header_->tensor_bytes);
+}
+
+const float* ImageCache::Find(const std::string& path) const {
+  std::unordered_map<std::string, int>::const_iterator it = index_.find(path);
+  return it == index_.end() ? nullptr : Tensor(it->second);
+}
+
+ImageCacheWriter::ImageCacheWriter(const std::string& file_name, cv::Size geometry, int channels,
+                                   const std::vector<float>& mean, cv::Size reduced)
+  : file_name_(file_name),
+    tmp_file_name_(file_name + ".tmp") {
+  fill_header(&header_, geometry, channels, mean, reduced);
+  file_.open(tmp_file_name_.c_str(), std::ofstream::binary | std::ofstream::trunc);
+  CHECK(file_) << "Unable to create image cache " << tmp_file_name_;
+
+  /* Header is rewritten with the final values on Close(). */
+  file_.write(reinterpret_cast<const char*>(&header_), sizeof(header_));
+  file_.seekp(header_.data_offset);
+}
+
+void ImageCacheWriter::Add(const std::string& path, const float* tensor) {
+  const size_t bytes = size_t(header_.channels) * header_.width * header_.height * sizeof(float);
+  static const char padding[CACHE_ALIGN] = {};
+  file_.write(reinterpret_cast<const char*>(tensor), bytes);
+  file_.write(padding, header_.tensor_bytes - bytes);
+  paths_.push_back(path);
+}
+
+void ImageCacheWriter::Close() {
+  header_.images = paths_.size();
+  header_.index_offset = header_.data_offset + paths_.size() * header_.tensor_bytes;
+  for (size_t i = 0; i < paths_.size(); ++i) {
+    uint32_t len = paths_[i].size();
+    file_.write(reinterpret_cast<const char*>(&len), sizeof(len));
+    file_.write(paths_[i].data(), len);
+  }
+  file_.seekp(0);
+  file_.write(reinterpret_cast<const char*>(&header_), sizeof(header_));
+  file_.close();
+  CHECK(file_) << "Unable to write image cache " << tmp_file_name_;
+  CHECK_EQ(rename(tmp_file_name_.c_str(), file_name_.c_str()), 0)
+    << "Unable to move image cache to " << file_name_;
+}
@@ -0,0 +1,93 @@
+#ifndef IMAGE_CACHE_H
+#define IMAGE_CACHE_H
+
+#include <opencv2/core/core.hpp>
+
+#include <stdint.h>
+
+#include <fstream>
+#include <string>
+#include <unordered_map>
+#include <vector>
+
+/* On-disk cache of images already converted to the network input format:
+ * resized, mean-subtracted planar float tensors, one per image path.
+ * A cache file is valid for a single input geometry, mean and decode mode,
+ * which are stored in its header, so a cache made for another model or
+ * with images decoded at reduced scale for another target is ignored.
+ *
+ * File layout: header, then tensors aligned to cache lines in order of
+ * adding, then the index of image paths in the same order. The file is
+ * memory mapped when opened, tensors are used straight from the mapping. */
+
+struct ImageCacheHeader {
+  char magic[8];
+  uint32_t width;
+  uint32_t height;
+  uint32_t channels;
+  uint32_t images;
+  float mean[4];
+  // Target size of reduced decoding, zero when images are decoded in full
+  uint32_t reduced_width;
+  uint32_t reduced_height;
+  uint64_t data_offset;
+  uint64_t tensor_bytes;
+  uint64_t index_offset;
+};
+
+class ImageCache {
+public:
+  ImageCache() {}
+  ~ImageCache();
+
+  // Map the cache file. Returns false if there is no such file or it was
+  // made for another input geometry, mean or decode mode. `reduced` is the
+  // target size of reduced decoding, an empty size for full decoding.
+  bool Open(const std::string& file_name, cv::Size geometry, int channels,
+            const std::vector<float>& mean, cv::Size reduced);
+
+  // Tensor of the image or nullptr if the image is not cached.
+  const float* Find(const std::string& path) const;
+
+  int size() const { return paths_.size(); }
+  const std::string& Path(int index) const { return paths_[index]; }
+  const float* Tensor(int index) const;
+
+private:
+  ImageCache(const ImageCache&);
+  ImageCache& operator=(const ImageCache&);
+
+  void Close();
+
+private:
+  const uint8_t* data_ = nullptr;
+  size_t size_ = 0;
+  const ImageCacheHeader* header_ = nullptr;
+  std::vector<std::string> paths_;
+  std::unordered_map<std::string, int> index_;
+};
+
+/* Writes a new cache file. Data goes to a temporary file which replaces
+ * the target file on Close(), so a cache being read is never damaged. */
+class ImageCacheWriter {
+public:
+  ImageCacheWriter(const std::string& file_name, cv::Size geometry, int channels,
+                   const std::vector<float>& mean, cv::Size reduced);
+
+  // Append a tensor of channels * height * width floats.
+  void Add(const std::string& path, const float* tensor);
+
+  // Write the index and move the file in place.
+  void Close();
+
+  int size() const { return paths_.size(); }
+
+private:
+  std::string file_name_;
+  std::string tmp_file_name_;
+  std::ofstream file_;
+  ImageCacheHeader header_;
+  std::vector<std::string> paths_;
+};
+
+#endif // IMAGE_CACHE_H
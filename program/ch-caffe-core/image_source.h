@@ -0,0 +1,116 @@
+#ifndef IMAGE_SOURCE_H
+#define IMAGE_SOURCE_H
+
+#include <glog/logging.h>
+
+#include <dirent.h>
+#include <string.h>
+#include <strings.h>
+#include <sys/stat.h>
+
+#include <algorithm>
+#include <fstream>
+#include <queue>
+#include <sstream>
+#include <string>
+#include <vector>
+
+/* Selection of image files to process: the window [skip, skip + count) of
+ * images ordered by file name. Only the selected paths are ever kept, so
+ * startup time doesn't depend much on the size of the dataset.
+ *
+ * Images are taken from a manifest file when it is given, or from a
+ * directory otherwise. A manifest lists one image per line, the first
+ * token of the line is the file name relative to the images directory,
+ * anything after it (e.g. a label as in `val.txt`) is ignored. Manifest
+ * is read up to the end of the window only. A directory is read entry by
+ * entry, keeping the skip + count smallest names in a bounded heap instead
+ * of collecting and sorting all of them. */
+
+inline bool is_jpeg_file_name(const char* name, size_t len) {
+  static const char* const EXTENSIONS[] = { ".jpg", ".jpeg" };
+  for (size_t i = 0; i < sizeof(EXTENSIONS)/sizeof(EXTENSIONS[0]); ++i) {
+    size_t ext_len = strlen(EXTENSIONS[i]);
+    if (len > ext_len && strcasecmp(name + len - ext_len, EXTENSIONS[i]) == 0)
+      return true;
+  }
+  return false;
+}
+
+inline std::string join_image_path(const std::string& dir, const std::string& name) {
+  if (name.empty() || name[0] == '/' || dir.empty())
+    return name;
+  return dir[dir.size()-1] == '/' ? dir + name : dir + '/' + name;
+}
+
+inline std::vector<std::string> list_images_from_manifest(const std::string& manifest,
+                                                          const std::string& dir,
+                                                          int skip, int count) {
+  std::ifstream file(manifest.c_str());
+  CHECK(file) << "Unable to open image list " << manifest;
+
+  std::vector<std::string> images;
+  images.reserve(count);
+  std::string line, name;
+  int index = 0;
+  while (int(images.size()) < count && std::getline(file, line)) {
+    std::istringstream tokens(line);
+    if (!(tokens >> name))
+      continue;
+    if (index++ >= skip)
+      images.push_back(join_image_path(dir, name));
+  }
+  return images;
+}
+
+inline std::vector<std::string> list_images_in_dir(const std::string& dir, int skip, int count) {
+  if (count <= 0)
+    return std::vector<std::string>();
+  DIR* d = opendir(dir.c_str());
+  CHECK(d) << "Unable to open images directory " << dir;
+
+  // Max-heap of the smallest names seen so far
+  const size_t limit = size_t(skip) + count;
+  std::priority_queue<std::string> smallest;
+  while (dirent* entry = readdir(d)) {
+    const char* name = entry->d_name;
+    const size_t len = strlen(name);
+    if (!is_jpeg_file_name(name, len))
+      continue;
+    if (smallest.size() == limit && !(name < smallest.top()))
+      continue;
+
+    // Stat only symlinks and entries of filesystems not reporting types
+    if (entry->d_type != DT_REG) {
+      if (entry->d_type != DT_LNK && entry->d_type != DT_UNKNOWN)
+        continue;
+      struct stat st;
+      if (stat(join_image_path(dir, name).c_str(), &st) != 0 || !S_ISREG(st.st_mode))
+        continue;
+    }
+
+    if (smallest.size() == limit)
+      smallest.pop();
+    smallest.push(std::string(name, len));
+  }
+  closedir(d);
+
+  // Heap gives names in descending order, drop the `skip` smallest ones
+  const int available = int(smallest.size()) - skip;
+  std::vector<std::string> images(std::max(available, 0));
+  for (int i = available - 1; i >= 0; --i) {
+    images[i] = join_image_path(dir, smallest.top());
+    smallest.pop();
+  }
+  return images;
+}
+
+// Images of the window [skip, skip + count), from manifest if it's not empty.
+inline std::vector<std::string> list_images(const std::string& dir, const std::string& manifest,
+                                            int skip, int count) {
+  if (!manifest.empty())
+    return list_images_from_manifest(manifest, dir, skip, count);
+  return list_images_in_dir(dir, skip, count);
+}
+
+#endif // IMAGE_SOURCE_H
@@ -0,0 +1,113 @@
+#ifndef JPEG_DECODE_H
+#define JPEG_DECODE_H
+
+#include <glog/logging.h>
+#include <opencv2/core/core.hpp>
+#include <opencv2/imgcodecs/imgcodecs.hpp>
+
+#include <stdint.h>
+#include <stdio.h>
+
+#include <string>
+#include <vector>
+
+/* Decoding of JPEG images at reduced resolution. libjpeg can scale an
+ * image by 1/2, 1/4 or 1/8 while decoding, in the DCT domain, which
+ * skips most of the work of decoding the full image. Images are going
+ * to be resized to the network input anyway, so the smallest scale that
+ * still covers the input geometry is taken and only a small resize is
+ * left for PrepareImage. OpenCV exposes this as IMREAD_REDUCED_* flags.
+ * The image size needed to choose the scale is read from the SOF marker
+ * of the file before decoding. */
+
+struct JpegInfo {
+  int width = 0;
+  int height = 0;
+  int components = 0;
+};
+
+// Parse JPEG markers up to the start of frame. Returns false if data
+// is not a JPEG image or the frame header is not found.
+inline bool jpeg_info(const uint8_t* data, size_t size, JpegInfo* info) {
+  if (size < 4 || data[0] != 0xFF || data[1] != 0xD8)
+    return false;
+  size_t pos = 2;
+  while (pos + 4 <= size) {
+    if (data[pos] != 0xFF)
+      return false;
+    uint8_t marker = data[pos + 1];
+    if (marker == 0xFF) {
+      // Fill byte
+      pos++;
+      continue;
+    }
+    // Markers without payload
+    if (marker == 0x01 || (marker >= 0xD0 && marker <= 0xD7)) {
+      pos += 2;
+      continue;
+    }
+    const size_t length = (size_t(data[pos + 2]) << 8) | data[pos + 3];
+    // SOF0..SOF15 except DHT, JPG and DAC
+    if (marker >= 0xC0 && marker <= 0xCF && marker != 0xC4 && marker != 0xC8 && marker != 0xCC) {
+      if (length < 8 || pos + 10 > size)
+        return false;
+      const uint8_t* sof = data + pos + 4;
+      info->height = (sof[1] << 8) | sof[2];
+      info->width = (sof[3] << 8) | sof[4];
+      info->components = sof[5];
+      return info->width > 0 && info->height > 0;
+    }
+    // Start of scan or end of image before the frame header
+    if (marker == 0xDA || marker == 0xD9)
+      return false;
+    pos += 2 + length;
+  }
+  return false;
+}
+
+// Largest of 1, 2, 4 or 8 by which the image can be scaled
+// while still covering the target geometry.
+inline int jpeg_reduction(int width, int height, cv::Size target) {
+  int scale = 1;
+  while (scale < 8 &&
+         (width + 2 * scale - 1) / (2 * scale) >= target.width &&
+         (height + 2 * scale - 1) / (2 * scale) >= target.height)
+    scale *= 2;
+  return scale;
+}
+
+// Decode an image file, at reduced resolution when it's a JPEG at least
+// twice as large as the target geometry. Other files are decoded as is.
+// EXIF orientation is ignored in both cases, as it is by full decoding
+// with IMREAD_UNCHANGED, so both modes give images of the same layout.
+inline cv::Mat decode_image_reduced(const std::string& file_name, cv::Size target) {
+  // Every decode thread reuses its own buffer for file contents
+  static thread_local std::vector<uint8_t> buffer;
+
+  FILE* file = fopen(file_name.c_str(), "rb");
+  CHECK(file) << "Unable to open image " << file_name;
+  fseek(file, 0, SEEK_END);
+  long size = ftell(file);
+  fseek(file, 0, SEEK_SET);
+  CHECK_GT(size, 0) << "Unable to read image " << file_name;
+  buffer.resize(size);
+  size_t read = fread(buffer.data(), 1, size, file);
+  fclose(file);
+  CHECK_EQ(read, size_t(size)) << "Unable to read image " << file_name;
+
+  int flags = cv::IMREAD_UNCHANGED;
+  JpegInfo info;
+  if (jpeg_info(buffer.data(), buffer.size(), &info)) {
+    const bool gray = info.components == 1;
+    switch (jpeg_reduction(info.width, info.height, target)) {
+      case 2: flags = gray ? cv::IMREAD_REDUCED_GRAYSCALE_2 : cv::IMREAD_REDUCED_COLOR_2; break;
+      case 4: flags = gray ? cv::IMREAD_REDUCED_GRAYSCALE_4 : cv::IMREAD_REDUCED_COLOR_4; break;
+      case 8: flags = gray ? cv::IMREAD_REDUCED_GRAYSCALE_8 : cv::IMREAD_REDUCED_COLOR_8; break;
+    }
+    if (flags != cv::IMREAD_UNCHANGED)
+      flags |= cv::IMREAD_IGNORE_ORIENTATION;
+  }
+  return cv::imdecode(cv::Mat(1, buffer.size(), CV_8UC1, buffer.data()), flags);
+}
+
+#endif // JPEG_DECODE_H
@@ -0,0 +1,144 @@
+#ifndef JSON_WRITER_H
+#define JSON_WRITER_H
+
+#include <glog/logging.h>
+
+#include <stdint.h>
+#include <stdio.h>
+#include <string.h>
+
+#include <fstream>
+#include <memory>
+#include <ostream>
+#include <string>
+#include <vector>
+
+/* Streaming JSON writer. Values are written to the stream as soon as they
+ * are added, so arbitrarily long arrays (e.g. results of every image) are
+ * never kept in memory. Output is compact, without any whitespace, and
+ * numbers are formatted with snprintf instead of stream formatting.
+ * Structure is not validated beyond tracking commas between elements. */
+class JsonWriter {
+public:
+  explicit JsonWriter(std::ostream& out): out_(out) {}
+
+  JsonWriter& BeginObject() { Separate(); out_.put('{'); first_.push_back(true); return *this; }
+  JsonWriter& EndObject() { out_.put('}'); first_.pop_back(); return *this; }
+  JsonWriter& BeginArray() { Separate(); out_.put('['); first_.push_back(true); return *this; }
+  JsonWriter& EndArray() { out_.put(']'); first_.pop_back(); return *this; }
+
+  // Key of the next value of an object.
+  JsonWriter& Key(const char* key) {
+    Separate();
+    String(key, strlen(key));
+    out_.put(':');
+    after_key_ = true;
+    return *this;
+  }
+
+  JsonWriter& Value(const std::string& value) { Separate(); String(value.data(), value.size()); return *this; }
+  JsonWriter& Value(const char* value) { Separate(); String(value, strlen(value)); return *this; }
+  JsonWriter& Value(bool value) { Separate(); out_ << (value ? "true" : "false"); return *this; }
+  JsonWriter& Value(int value) { return Value(int64_t(value)); }
+  JsonWriter& Value(int64_t value) {
+    char buf[32];
+    Separate();
+    out_.write(buf, snprintf(buf, sizeof(buf), "%lld", (long long)value));
+    return *this;
+  }
+  JsonWriter& Value(uint64_t value) {
+    char buf[32];
+    Separate();
+    out_.write(buf, snprintf(buf, sizeof(buf), "%llu", (unsigned long long)value));
+    return *this;
+  }
+  // Infinity and NaN are not valid JSON, they are written as null.
+  JsonWriter& Value(double value) {
+    char buf[32];
+    Separate();
+    if (value != value || value - value != 0)
+      out_ << "null";
+    else
+      out_.write(buf, snprintf(buf, sizeof(buf), "%.6g", value));
+    return *this;
+  }
+
+  template <typename T>
+  JsonWriter& Field(const char* key, const T& value) { return Key(key).Value(value); }
+
+private:
+  // Comma before every element except the first one of an object or array.
+  void Separate() {
+    if (after_key_) {
+      after_key_ = false;
+      return;
+    }
+    if (!first_.empty()) {
+      if (!first_.back())
+        out_.put(',');
+      first_.back() = false;
+    }
+  }
+
+  void String(const char* s, size_t len) {
+    out_.put('"');
+    for (size_t i = 0; i < len; ++i) {
+      const unsigned char c = s[i];
+      if (c == '"' || c == '\\') {
+        out_.put('\\');
+        out_.put(c);
+      }
+      else if (c < 0x20) {
+        char buf[8];
+        out_.write(buf, snprintf(buf, sizeof(buf), "\\u%04x", c));
+      }
+      else
+        out_.put(c);
+    }
+    out_.put('"');
+  }
+
+private:
+  std::ostream& out_;
+  std::vector<bool> first_;
+  bool after_key_ = false;
+};
+
+/* JSON file written by a JsonWriter through a large buffer, so results
+ * can be streamed into it during a benchmark with few write calls.
+ * Failing to create or write the file is fatal, as partial results
+ * would silently look like complete ones. */
+class JsonFile {
+public:
+  // Nothing is written when the file name is empty.
+  explicit JsonFile(const std::string& file_name)
+    : file_name_(file_name), buffer_(file_name.empty() ? 0 : 1 << 20) {
+    if (file_name.empty())
+      return;
+    file_.rdbuf()->pubsetbuf(buffer_.data(), buffer_.size());
+    file_.open(file_name.c_str(), std::ofstream::trunc);
+    CHECK(file_) << "Unable to create " << file_name;
+    json_.reset(new JsonWriter(file_));
+  }
+
+  bool enabled() const { return json_ != nullptr; }
+
+  JsonWriter& json() { return *json_; }
+
+  void Close() {
+    if (!enabled())
+      return;
+    file_ << std::endl;
+    file_.close();
+    CHECK(file_) << "Unable to write " << file_name_;
+    json_.reset();
+  }
+
+private:
+  std::string file_name_;
+  std::vector<char> buffer_;
+  std::ofstream file_;
+  std::unique_ptr<JsonWriter> json_;
+};
+
+#endif // JSON_WRITER_H
@@ -0,0 +1,331 @@
+#ifndef LMDB_READER_H
+#define LMDB_READER_H
+
+#include "caffe_datum.h"
+
+#include <lmdb.h>
+
+#include <stdint.h>
+#include <stdlib.h>
+
+#include <algorithm>
+#include <exception>
+#include <functional>
+#include <memory>
+#include <stdexcept>
+#include <string>
+#include <thread>
+#include <vector>
+
+/* Read-only access to a Caffe LMDB dataset. Records are iterated in key
+ * order and parsed into CaffeDatum views, nothing is copied: keys, values
+ * and image data point into memory mapped pages of the database and stay
+ * valid while the transaction they are read in is open. */
+
+// Failed LMDB call, keeps the code it returned.
+class LmdbError : public std::runtime_error {
+public:
+  LmdbError(const std::string& what, int code): std::runtime_error(what), code_(code) {}
+
+  int code() const { return code_; }
+
+  // Name and description of the error code.
+  std::string describe() const { return describe(code_); }
+
+  static std::string describe(int code) {
+    switch (code) {
+      case MDB_KEYEXIST: return "(MDB_KEYEXIST) key/data pair already exists";
+      case MDB_NOTFOUND: return "(MDB_NOTFOUND) key/data pair not found (EOF)";
+      case MDB_PAGE_NOTFOUND: return "(MDB_PAGE_NOTFOUND) Requested page not found - this usually indicates corruption";
+      case MDB_CORRUPTED: return "(MDB_CORRUPTED) Located page was wrong type";
+      case MDB_PANIC: return "(MDB_PANIC) Update of meta page failed or environment had fatal error";
+      case MDB_VERSION_MISMATCH: return "(MDB_VERSION_MISMATCH) Environment version mismatch";
+      case MDB_INVALID: return "(MDB_INVALID) File is not a valid LMDB file";
+      case MDB_MAP_FULL: return "(MDB_MAP_FULL) Environment mapsize reached";
+      case MDB_DBS_FULL: return "(MDB_DBS_FULL) Environment maxdbs reached";
+      case MDB_READERS_FULL: return "(MDB_READERS_FULL) Environment maxreaders reached";
+      case MDB_TLS_FULL: return "(MDB_TLS_FULL) Too many TLS keys in use - Windows only";
+      case MDB_TXN_FULL: return "(MDB_TXN_FULL) Txn has too many dirty pages";
+      case MDB_CURSOR_FULL: return "(MDB_CURSOR_FULL) Cursor stack too deep - internal error";
+      case MDB_PAGE_FULL: return "(MDB_PAGE_FULL) Page has not enough space - internal error";
+      case MDB_MAP_RESIZED: return "(MDB_MAP_RESIZED) Database contents grew beyond environment mapsize";
+      case MDB_INCOMPATIBLE: return "(MDB_INCOMPATIBLE) Operation and DB incompatible, or DB type changed";
+      case MDB_BAD_RSLOT: return "(MDB_BAD_RSLOT) Invalid reuse of reader locktable slot";
+      case MDB_BAD_TXN: return "(MDB_BAD_TXN) Transaction must abort, has a child, or is invalid";
+      case MDB_BAD_VALSIZE: return "(MDB_BAD_VALSIZE) Unsupported size of key/DB name/data, or wrong DUPFIXED size";
+      case MDB_BAD_DBI: return "(MDB_BAD_DBI) The specified DBI was changed unexpectedly";
+      default: return mdb_strerror(code);
+    }
+  }
+
+private:
+  int code_;
+};
+
+inline void lmdb_check(int code, const char* what) {
+  if (code != MDB_SUCCESS)
+    throw LmdbError(what, code);
+}
+
+// Record of the database. Key in Caffe ImageNet LMDB is source image file
+// name, value is binary serialized Caffe Datum protobuf message.
+struct LmdbRecord {
+  MDB_val key;
+  MDB_val value;
+  CaffeDatum datum;
+
+  std::string key_str() const {
+    return std::string(reinterpret_cast<const char*>(key.mv_data), key.mv_size);
+  }
+};
+
+// Read-only transaction, aborted when destroyed.
+class LmdbReadTxn {
+public:
+  explicit LmdbReadTxn(MDB_env* env) {
+    // Transactions are always required, even for read-only access.
+    lmdb_check(mdb_txn_begin(env, nullptr, MDB_RDONLY, &txn_), "Unable to open transaction");
+  }
+  ~LmdbReadTxn() { mdb_txn_abort(txn_); }
+
+  LmdbReadTxn(const LmdbReadTxn&) = delete;
+  LmdbReadTxn& operator=(const LmdbReadTxn&) = delete;
+
+  MDB_txn* get() const { return txn_; }
+
+private:
+  MDB_txn* txn_ = nullptr;
+};
+
+// Input iterator over records in key order. Owns its cursor, so it can
+// be moved but not copied. Default constructed iterator is the end.
+class LmdbIterator {
+public:
+  LmdbIterator() {}
+
+  // Iterate from the first record, or from the first record
+  // with key not less than `start_key` when it's given.
+  LmdbIterator(MDB_txn* txn, MDB_dbi dbi, const std::string* start_key = nullptr) {
+    lmdb_check(mdb_cursor_open(txn, dbi, &cursor_), "Unable to open cursor");
+    try {
+      if (start_key) {
+        record_.key.mv_size = start_key->size();
+        record_.key.mv_data = const_cast<char*>(start_key->data());
+        Fetch(MDB_SET_RANGE);
+      }
+      else
+        Fetch(MDB_FIRST);
+    }
+    catch (...) {
+      Close();
+      throw;
+    }
+  }
+
+  LmdbIterator(LmdbIterator&& other): cursor_(other.cursor_), record_(other.record_) {
+    other.cursor_ = nullptr;
+  }
+
+  ~LmdbIterator() { Close(); }
+
+  LmdbIterator(const LmdbIterator&) = delete;
+  LmdbIterator& operator=(const LmdbIterator&) = delete;
+
+  const LmdbRecord& operator*() const { return record_; }
+  const LmdbRecord* operator->() const { return &record_; }
+
+  LmdbIterator& operator++() {
+    Fetch(MDB_NEXT);
+    return *this;
+  }
+
+  bool operator==(const LmdbIterator& other) const { return cursor_ == other.cursor_; }
+  bool operator!=(const LmdbIterator& other) const { return cursor_ != other.cursor_; }
+
+private:
+  void Fetch(MDB_cursor_op op) {
+    int code = mdb_cursor_get(cursor_, &record_.key, &record_.value, op);
+    if (code == MDB_NOTFOUND) {
+      // No more records in database
+      Close();
+      return;
+    }
+    lmdb_check(code, "Unable to fetch key-value pair");
+    record_.datum = CaffeDatum();
+    record_.datum.parse(reinterpret_cast<const char*>(record_.value.mv_data), record_.value.mv_size);
+  }
+
+  void Close() {
+    if (cursor_)
+      mdb_cursor_close(cursor_);
+    cursor_ = nullptr;
+  }
+
+private:
+  MDB_cursor* cursor_ = nullptr;
+  LmdbRecord record_;
+};
+
+// Consumer of records read in parallel, it is called concurrently from
+// worker threads. The record is valid only during the call.
+typedef std::function<void(int worker, const LmdbRecord& record)> DatumConsumer;
+
+struct LmdbReadStats {
+  int64_t records = 0;
+  int64_t bytes = 0;
+};
+
+// Key at fraction `f` of the way from `lo` to `hi`. Bytes after the common
+// prefix of the keys are taken as digits of a mixed-radix number, every digit
+// spans byte values the two keys have at its position. Keys of Caffe LMDB
+// start with a zero-padded record number, so they are split evenly. For other
+// keys ranges may be less even, but they are always ordered and cover all keys.
+inline std::string interpolate_key(const std::string& lo, const std::string& hi, double f) {
+  size_t prefix = 0;
+  while (prefix < lo.size() && prefix < hi.size() && lo[prefix] == hi[prefix])
+    prefix++;
+  auto byte_at = [](const std::string& key, size_t i) { return i < key.size() ? int(uint8_t(key[i])) : 0; };
+  std::vector<int> base, radix;
+  uint64_t lo_value = 0, hi_value = 0, scale = 1;
+  for (size_t i = prefix; i < std::max(lo.size(), hi.size()) && scale < (uint64_t(1) << 48); i++) {
+    int a = byte_at(lo, i), b = byte_at(hi, i);
+    base.push_back(std::min(a, b));
+    radix.push_back(abs(a - b) + 1);
+    lo_value = lo_value * radix.back() + (a - base.back());
+    hi_value = hi_value * radix.back() + (b - base.back());
+    scale *= radix.back();
+  }
+  uint64_t value = lo_value + uint64_t(double(hi_value - lo_value) * f);
+  std::string key = lo.substr(0, prefix);
+  key.resize(prefix + base.size());
+  for (size_t i = base.size(); i-- > 0; ) {
+    key[prefix + i] = char(base[i] + value % radix[i]);
+    value /= radix[i];
+  }
+  return key;
+}
+
+/* Caffe LMDB dataset opened for reading. The environment and a read-only
+ * transaction, which records of begin() and seek() belong to, are kept
+ * open for the lifetime of the reader. Iterating in a range-for loop:
+ *
+ *   LmdbDatumReader reader(path);
+ *   for (const LmdbRecord& record : reader)
+ *     consume(record.datum);
+ */
+class LmdbDatumReader {
+public:
+  explicit LmdbDatumReader(const std::string& path) {
+    lmdb_check(mdb_env_create(&env_), "Unable to create environment");
+    try {
+      // MDB_NOTLS allows read transactions in any thread, several per thread
+      lmdb_check(mdb_env_open(env_, path.c_str(), MDB_RDONLY | MDB_NOTLS | MDB_NOLOCK, 0664),
+                 "Unable to open environment");
+      txn_.reset(new LmdbReadTxn(env_));
+      lmdb_check(mdb_dbi_open(txn_->get(), nullptr, 0, &dbi_), "Unable to open database");
+    }
+    catch (...) {
+      txn_.reset();
+      mdb_env_close(env_);
+      throw;
+    }
+  }
+
+  // Closing a database handle is not necessary, it is closed
+  // with the environment.
+  ~LmdbDatumReader() {
+    txn_.reset();
+    mdb_env_close(env_);
+  }
+
+  LmdbDatumReader(const LmdbDatumReader&) = delete;
+  LmdbDatumReader& operator=(const LmdbDatumReader&) = delete;
+
+  LmdbIterator begin() const { return LmdbIterator(txn_->get(), dbi_); }
+  LmdbIterator end() const { return LmdbIterator(); }
+
+  // Iterate from the first record with key not less than the given one.
+  LmdbIterator seek(const std::string& key) const { return LmdbIterator(txn_->get(), dbi_, &key); }
+
+  // Keys of the first and the last records. Returns false if database is empty.
+  bool KeyRange(std::string* first_key, std::string* last_key) const;
+
+  // Read all records with several threads. Keys are split into ranges by keys
+  // interpolated between the first and the last ones, every worker positions
+  // its own read-only transaction and cursor at the beginning of its range
+  // with MDB_SET_RANGE and reads up to the next range. Returns counts of
+  // records read by every worker. Rethrows an error of any worker.
+  std::vector<LmdbReadStats> ReadParallel(int workers, const DatumConsumer& consume) const;
+
+  MDB_env* env() const { return env_; }
+  MDB_dbi dbi() const { return dbi_; }
+
+private:
+  MDB_env* env_ = nullptr;
+  MDB_dbi dbi_ = 0;
+  std::unique_ptr<LmdbReadTxn> txn_;
+};
+
+inline bool LmdbDatumReader::KeyRange(std::string* first_key, std::string* last_key) const {
+  MDB_cursor* cursor;
+  lmdb_check(mdb_cursor_open(txn_->get(), dbi_, &cursor), "Unable to open cursor");
+  MDB_val key, value;
+  int code = mdb_cursor_get(cursor, &key, &value, MDB_FIRST);
+  if (code == MDB_SUCCESS) {
+    first_key->assign(reinterpret_cast<const char*>(key.mv_data), key.mv_size);
+    code = mdb_cursor_get(cursor, &key, &value, MDB_LAST);
+  }
+  if (code == MDB_SUCCESS)
+    last_key->assign(reinterpret_cast<const char*>(key.mv_data), key.mv_size);
+  mdb_cursor_close(cursor);
+  if (code == MDB_NOTFOUND)
+    return false;
+  lmdb_check(code, "Unable to fetch key-value pair");
+  return true;
+}
+
+inline std::vector<LmdbReadStats> LmdbDatumReader::ReadParallel(int workers, const DatumConsumer& consume) const {
+  std::vector<LmdbReadStats> stats(workers);
+  std::string first_key, last_key;
+  if (!KeyRange(&first_key, &last_key))
+    return stats;
+
+  std::vector<std::string> range_keys(workers);
+  for (int i = 1; i < workers; i++)
+    range_keys[i] = interpolate_key(first_key, last_key, double(i) / workers);
+
+  std::vector<std::exception_ptr> errors(workers);
+  auto run_worker = [&](int worker) {
+    try {
+      LmdbReadTxn txn(env_);
+      MDB_val end_key;
+      const bool has_end = worker + 1 < workers;
+      if (has_end) {
+        end_key.mv_size = range_keys[worker + 1].size();
+        end_key.mv_data = const_cast<char*>(range_keys[worker + 1].data());
+      }
+      for (LmdbIterator it(txn.get(), dbi_, worker > 0 ? &range_keys[worker] : nullptr); it != end(); ++it) {
+        if (has_end && mdb_cmp(txn.get(), dbi_, &it->key, &end_key) >= 0)
+          break;
+        consume(worker, *it);
+        stats[worker].records++;
+        stats[worker].bytes += it->value.mv_size;
+      }
+    }
+    catch (...) {
+      errors[worker] = std::current_exception();
+    }
+  };
+
+  std::vector<std::thread> threads;
+  for (int i = 0; i < workers; i++)
+    threads.push_back(std::thread(run_worker, i));
+  for (size_t i = 0; i < threads.size(); i++)
+    threads[i].join();
+  for (size_t i = 0; i < errors.size(); i++)
+    if (errors[i])
+      std::rethrow_exception(errors[i]);
+  return stats;
+}
+
+#endif // LMDB_READER_H
@@ -0,0 +1,195 @@
+#ifndef PREPROCESS_H
+#define PREPROCESS_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+#if defined(__GNUC__) && (defined(__x86_64__) || defined(__i386__))
+#define PREPROCESS_X86
+#include <immintrin.h>
+#elif defined(__ARM_NEON) || defined(__ARM_NEON__)
+#define PREPROCESS_NEON
+#include <arm_neon.h>
+#endif
+
+/* Fused preprocessing of decoded 8-bit images.
+ *
+ * Source is an interleaved 8-bit image in OpenCV channel order (gray, BGR
+ * or BGRA) already resized to the network input geometry. Destination is
+ * a set of planar float channels (gray or BGR), usually wrapping the input
+ * blob of a network. Channel conversion, conversion to float, mean
+ * subtraction and de-interleaving are done in one pass over the image,
+ * without any intermediate buffers. The common BGR -> BGR case is
+ * vectorized with AVX2, SSSE3 or NEON, depending on the host CPU. */
+
+// Same fixed point coefficients as OpenCV uses for 8-bit BGR2GRAY.
+inline uint8_t bgr_to_gray(uint8_t b, uint8_t g, uint8_t r) {
+  return (b * 1868 + g * 9617 + r * 4899 + (1 << 13)) >> 14;
+}
+
+// Process pixels [x, width) of one row.
+inline void preprocess_row_scalar(const uint8_t* src, int x, int width, int src_channels,
+                                  const float* mean, float* const* dst, int dst_channels) {
+  src += x * src_channels;
+  for (; x < width; ++x, src += src_channels) {
+    if (dst_channels == 1) {
+      uint8_t gray = src_channels == 1 ? src[0] : bgr_to_gray(src[0], src[1], src[2]);
+      dst[0][x] = gray - mean[0];
+    }
+    else {
+      for (int c = 0; c < 3; ++c)
+        dst[c][x] = (src_channels == 1 ? src[0] : src[c]) - mean[c];
+    }
+  }
+}
+
+// Vectorized BGR -> BGR row kernel. Returns number of processed pixels,
+// the rest of the row is left for the scalar kernel.
+typedef int (*BgrRowKernel)(const uint8_t* src, int width, const float* mean,
+                            float* b, float* g, float* r);
+
+#ifdef PREPROCESS_X86
+
+#define BGR_SHUFFLE_MASKS \
+  const __m128i mask_b0 = _mm_setr_epi8(0, 3, 6, 9, 12, 15, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1); \
+  const __m128i mask_b1 = _mm_setr_epi8(-1, -1, -1, -1, -1, -1, 2, 5, 8, 11, 14, -1, -1, -1, -1, -1); \
+  const __m128i mask_b2 = _mm_setr_epi8(-1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, 1, 4, 7, 10, 13); \
+  const __m128i mask_g0 = _mm_setr_epi8(1, 4, 7, 10, 13, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1); \
+  const __m128i mask_g1 = _mm_setr_epi8(-1, -1, -1, -1, -1, 0, 3, 6, 9, 12, 15, -1, -1, -1, -1, -1); \
+  const __m128i mask_g2 = _mm_setr_epi8(-1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, 2, 5, 8, 11, 14); \
+  const __m128i mask_r0 = _mm_setr_epi8(2, 5, 8, 11, 14, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1); \
+  const __m128i mask_r1 = _mm_setr_epi8(-1, -1, -1, -1, -1, 1, 4, 7, 10, 13, -1, -1, -1, -1, -1, -1); \
+  const __m128i mask_r2 = _mm_setr_epi8(-1, -1, -1, -1, -1, -1, -1, -1, -1, -1, 0, 3, 6, 9, 12, 15);
+
+// De-interleave 16 BGR pixels (48 bytes) into 16 bytes of every channel.
+#define BGR_DEINTERLEAVE(src, vb, vg, vr) \
+  __m128i p0 = _mm_loadu_si128(reinterpret_cast<const __m128i*>(src)); \
+  __m128i p1 = _mm_loadu_si128(reinterpret_cast<const __m128i*>(src + 16)); \
+  __m128i p2 = _mm_loadu_si128(reinterpret_cast<const __m128i*>(src + 32)); \
+  __m128i vb = _mm_or_si128(_mm_or_si128(_mm_shuffle_epi8(p0, mask_b0), \
+    _mm_shuffle_epi8(p1, mask_b1)), _mm_shuffle_epi8(p2, mask_b2)); \
+  __m128i vg = _mm_or_si128(_mm_or_si128(_mm_shuffle_epi8(p0, mask_g0), \
+    _mm_shuffle_epi8(p1, mask_g1)), _mm_shuffle_epi8(p2, mask_g2)); \
+  __m128i vr = _mm_or_si128(_mm_or_si128(_mm_shuffle_epi8(p0, mask_r0), \
+    _mm_shuffle_epi8(p1, mask_r1)), _mm_shuffle_epi8(p2, mask_r2));
+
+__attribute__((target("avx2")))
+inline void convert_u8x16_avx2(__m128i v, __m256 mean, float* dst) {
+  __m256 lo = _mm256_cvtepi32_ps(_mm256_cvtepu8_epi32(v));
+  __m256 hi = _mm256_cvtepi32_ps(_mm256_cvtepu8_epi32(_mm_srli_si128(v, 8)));
+  _mm256_storeu_ps(dst, _mm256_sub_ps(lo, mean));
+  _mm256_storeu_ps(dst + 8, _mm256_sub_ps(hi, mean));
+}
+
+__attribute__((target("avx2")))
+inline int preprocess_bgr_row_avx2(const uint8_t* src, int width, const float* mean,
+                                   float* b, float* g, float* r) {
+  BGR_SHUFFLE_MASKS
+  const __m256 mean_b = _mm256_set1_ps(mean[0]);
+  const __m256 mean_g = _mm256_set1_ps(mean[1]);
+  const __m256 mean_r = _mm256_set1_ps(mean[2]);
+  int x = 0;
+  for (; x + 16 <= width; x += 16, src += 48) {
+    BGR_DEINTERLEAVE(src, vb, vg, vr)
+    convert_u8x16_avx2(vb, mean_b, b + x);
+    convert_u8x16_avx2(vg, mean_g, g + x);
+    convert_u8x16_avx2(vr, mean_r, r + x);
+  }
+  return x;
+}
+
+__attribute__((target("ssse3")))
+inline void convert_u8x16_ssse3(__m128i v, __m128 mean, float* dst) {
+  const __m128i zero = _mm_setzero_si128();
+  __m128i lo = _mm_unpacklo_epi8(v, zero);
+  __m128i hi = _mm_unpackhi_epi8(v, zero);
+  _mm_storeu_ps(dst, _mm_sub_ps(_mm_cvtepi32_ps(_mm_unpacklo_epi16(lo, zero)), mean));
+  _mm_storeu_ps(dst + 4, _mm_sub_ps(_mm_cvtepi32_ps(_mm_unpackhi_epi16(lo, zero)), mean));
+  _mm_storeu_ps(dst + 8, _mm_sub_ps(_mm_cvtepi32_ps(_mm_unpacklo_epi16(hi, zero)), mean));
+  _mm_storeu_ps(dst + 12, _mm_sub_ps(_mm_cvtepi32_ps(_mm_unpackhi_epi16(hi, zero)), mean));
+}
+
+__attribute__((target("ssse3")))
+inline int preprocess_bgr_row_ssse3(const uint8_t* src, int width, const float* mean,
+                                    float* b, float* g, float* r) {
+  BGR_SHUFFLE_MASKS
+  const __m128 mean_b = _mm_set1_ps(mean[0]);
+  const __m128 mean_g = _mm_set1_ps(mean[1]);
+  const __m128 mean_r = _mm_set1_ps(mean[2]);
+  int x = 0;
+  for (; x + 16 <= width; x += 16, src += 48) {
+    BGR_DEINTERLEAVE(src, vb, vg, vr)
+    convert_u8x16_ssse3(vb, mean_b, b + x);
+    convert_u8x16_ssse3(vg, mean_g, g + x);
+    convert_u8x16_ssse3(vr, mean_r, r + x);
+  }
+  return x;
+}
+
+#undef BGR_DEINTERLEAVE
+#undef BGR_SHUFFLE_MASKS
+
+#endif // PREPROCESS_X86
+
+#ifdef PREPROCESS_NEON
+
+inline void convert_u8x16_neon(uint8x16_t v, float32x4_t mean, float* dst) {
+  uint16x8_t lo = vmovl_u8(vget_low_u8(v));
+  uint16x8_t hi = vmovl_u8(vget_high_u8(v));
+  vst1q_f32(dst, vsubq_f32(vcvtq_f32_u32(vmovl_u16(vget_low_u16(lo))), mean));
+  vst1q_f32(dst + 4, vsubq_f32(vcvtq_f32_u32(vmovl_u16(vget_high_u16(lo))), mean));
+  vst1q_f32(dst + 8, vsubq_f32(vcvtq_f32_u32(vmovl_u16(vget_low_u16(hi))), mean));
+  vst1q_f32(dst + 12, vsubq_f32(vcvtq_f32_u32(vmovl_u16(vget_high_u16(hi))), mean));
+}
+
+inline int preprocess_bgr_row_neon(const uint8_t* src, int width, const float* mean,
+                                   float* b, float* g, float* r) {
+  const float32x4_t mean_b = vdupq_n_f32(mean[0]);
+  const float32x4_t mean_g = vdupq_n_f32(mean[1]);
+  const float32x4_t mean_r = vdupq_n_f32(mean[2]);
+  int x = 0;
+  for (; x + 16 <= width; x += 16, src += 48) {
+    uint8x16x3_t pixels = vld3q_u8(src);
+    convert_u8x16_neon(pixels.val[0], mean_b, b + x);
+    convert_u8x16_neon(pixels.val[1], mean_g, g + x);
+    convert_u8x16_neon(pixels.val[2], mean_r, r + x);
+  }
+  return x;
+}
+
+#endif // PREPROCESS_NEON
+
+inline BgrRowKernel select_bgr_row_kernel() {
+#if defined(PREPROCESS_X86)
+  __builtin_cpu_init();
+  if (__builtin_cpu_supports("avx2"))
+    return preprocess_bgr_row_avx2;
+  if (__builtin_cpu_supports("ssse3"))
+    return preprocess_bgr_row_ssse3;
+#elif defined(PREPROCESS_NEON)
+  return preprocess_bgr_row_neon;
+#endif
+  return nullptr;
+}
+
+/* Convert 8-bit interleaved image of width*height pixels into planar float
+ * channels with subtracted per-channel mean. `src_step` is the row stride of
+ * the source in bytes, every destination plane is a continuous width*height
+ * array of floats, `mean` contains dst_channels values. */
+inline void preprocess_image(const uint8_t* src, size_t src_step,
+                             int width, int height, int src_channels,
+                             const float* mean, float* const* dst, int dst_channels) {
+  static const BgrRowKernel bgr_row_kernel = select_bgr_row_kernel();
+  const bool vectorized = bgr_row_kernel && src_channels == 3 && dst_channels == 3;
+
+  float* row[3];
+  for (int y = 0; y < height; ++y, src += src_step) {
+    for (int c = 0; c < dst_channels; ++c)
+      row[c] = dst[c] + y * width;
+
+    int x = vectorized ? bgr_row_kernel(src, width, mean, row[0], row[1], row[2]) : 0;
+    preprocess_row_scalar(src, x, width, src_channels, mean, row, dst_channels);
+  }
+}
+
+#endif // PREPROCESS_H
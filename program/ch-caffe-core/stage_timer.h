@@ -0,0 +1,251 @@
+#ifndef STAGE_TIMER_H
+#define STAGE_TIMER_H
+
+#include <stdint.h>
+
+#include <algorithm>
+#include <atomic>
+#include <fstream>
+#include <iomanip>
+#include <memory>
+#include <ostream>
+#include <string>
+#include <vector>
+
+#include "json_writer.h"
+
+/* Latency histogram with fixed log-scale buckets over nanoseconds. Every
+ * power of two is split into 8 linear sub-buckets, so a percentile is
+ * reported with relative error below 1/16. Recording is lock-free and
+ * doesn't allocate, so histograms can be updated from several threads
+ * in the hot loop. */
+class LatencyHistogram {
+public:
+  LatencyHistogram();
+
+  // Record `count` samples of the same value.
+  void Record(uint64_t ns, uint64_t count = 1);
+
+  uint64_t count() const { return count_.load(std::memory_order_relaxed); }
+  uint64_t min() const { return count() ? min_.load(std::memory_order_relaxed) : 0; }
+  uint64_t max() const { return max_.load(std::memory_order_relaxed); }
+  double mean() const { return count() ? double(sum_.load(std::memory_order_relaxed)) / count() : 0; }
+
+  // Value below which `percent` percents of samples fall.
+  uint64_t Percentile(double percent) const;
+
+private:
+  static const int SUB_BUCKETS = 8;
+  static const int SUB_BUCKET_BITS = 3;
+  static const int BUCKETS = (64 - SUB_BUCKET_BITS + 1) * SUB_BUCKETS;
+
+  static int BucketIndex(uint64_t ns);
+  static uint64_t BucketLow(int index);
+  static uint64_t BucketWidth(int index);
+
+  std::atomic<uint64_t> buckets_[BUCKETS];
+  std::atomic<uint64_t> count_;
+  std::atomic<uint64_t> sum_;
+  std::atomic<uint64_t> min_;
+  std::atomic<uint64_t> max_;
+};
+
+inline LatencyHistogram::LatencyHistogram(): count_(0), sum_(0), min_(UINT64_MAX), max_(0) {
+  for (int i = 0; i < BUCKETS; ++i)
+    buckets_[i].store(0, std::memory_order_relaxed);
+}
+
+// Values below SUB_BUCKETS have their own buckets, above that
+// index is made of the exponent and the next SUB_BUCKET_BITS bits.
+inline int LatencyHistogram::BucketIndex(uint64_t ns) {
+  if (ns < SUB_BUCKETS)
+    return int(ns);
+  int exponent = 63 - __builtin_clzll(ns);
+  int sub_bucket = int(ns >> (exponent - SUB_BUCKET_BITS)) & (SUB_BUCKETS - 1);
+  return (exponent - SUB_BUCKET_BITS + 1) * SUB_BUCKETS + sub_bucket;
+}
+
+inline uint64_t LatencyHistogram::BucketLow(int index) {
+  if (index < SUB_BUCKETS)
+    return index;
+  int exponent = index / SUB_BUCKETS + SUB_BUCKET_BITS - 1;
+  return uint64_t(SUB_BUCKETS + index % SUB_BUCKETS) << (exponent - SUB_BUCKET_BITS);
+}
+
+inline uint64_t LatencyHistogram::BucketWidth(int index) {
+  if (index < SUB_BUCKETS)
+    return 1;
+  return uint64_t(1) << (index / SUB_BUCKETS - 1);
+}
+
+inline void LatencyHistogram::Record(uint64_t ns, uint64_t count) {
+  if (count == 0)
+    return;
+  buckets_[BucketIndex(ns)].fetch_add(count, std::memory_order_relaxed);
+  count_.fetch_add(count, std::memory_order_relaxed);
+  sum_.fetch_add(ns * count, std::memory_order_relaxed);
+
+  uint64_t cur = min_.load(std::memory_order_relaxed);
+  while (ns < cur && !min_.compare_exchange_weak(cur, ns, std::memory_order_relaxed));
+  cur = max_.load(std::memory_order_relaxed);
+  while (ns > cur && !max_.compare_exchange_weak(cur, ns, std::memory_order_relaxed));
+}
+
+inline uint64_t LatencyHistogram::Percentile(double percent) const {
+  const uint64_t total = count();
+  if (total == 0)
+    return 0;
+  uint64_t rank = std::max<uint64_t>(1, uint64_t(percent / 100.0 * total + 0.5));
+  uint64_t seen = 0;
+  for (int i = 0; i < BUCKETS; ++i) {
+    seen += buckets_[i].load(std::memory_order_relaxed);
+    if (seen >= rank) {
+      // Middle of the bucket, but never outside of the observed range.
+      uint64_t value = BucketLow(i) + BucketWidth(i) / 2;
+      return std::min(std::max(value, min()), max());
+    }
+  }
+  return max();
+}
+
+/* Timings of processing stages (decode, preprocess, forward, etc.).
+ * Every stage keeps two histograms: time per image and time per batch.
+ * A stage measured per image gets its per-batch time as a sum over images
+ * of the batch. A stage measured per batch gets its per-image time as the
+ * batch time divided by the number of images. Stages are registered before
+ * the benchmark loop, recording doesn't allocate and is thread-safe. */
+class StageTimer {
+public:
+  enum Unit { PER_IMAGE, PER_BATCH };
+
+  // Register a stage, returns its id for Record* functions.
+  int AddStage(const std::string& name, Unit unit);
+
+  // Record time of a single image for a per-image stage.
+  void RecordImage(int stage, double seconds);
+
+  // Record times of all images of a batch for a per-image stage.
+  // Returns total time of the batch.
+  double RecordImages(int stage, const double* seconds, int images);
+
+  // Record time of a whole batch of `images` images.
+  void RecordBatch(int stage, double seconds, int images);
+
+  // Print percentiles of all stages as a table, in milliseconds.
+  void Print(std::ostream& out) const;
+
+  // Write percentiles of all stages as a JSON object, in milliseconds.
+  void WriteJson(JsonWriter& json) const;
+  // Write the file with a single "stages_ms" object.
+  void WriteJson(const std::string& file_name) const;
+
+private:
+  struct Stage {
+    Stage(const std::string& name, Unit unit): name(name), unit(unit) {}
+    std::string name;
+    Unit unit;
+    LatencyHistogram per_image;
+    LatencyHistogram per_batch;
+  };
+
+  static uint64_t ToNs(double seconds) { return seconds > 0 ? uint64_t(seconds * 1e9 + 0.5) : 0; }
+
+  static void PrintRow(std::ostream& out, const char* title, const LatencyHistogram& h);
+
+  static void WriteJson(JsonWriter& json, const LatencyHistogram& h);
+
+  std::vector<std::unique_ptr<Stage> > stages_;
+};
+
+inline int StageTimer::AddStage(const std::string& name, Unit unit) {
+  stages_.push_back(std::unique_ptr<Stage>(new Stage(name, unit)));
+  return int(stages_.size()) - 1;
+}
+
+inline void StageTimer::RecordImage(int stage, double seconds) {
+  stages_[stage]->per_image.Record(ToNs(seconds));
+}
+
+inline double StageTimer::RecordImages(int stage, const double* seconds, int images) {
+  double total = 0;
+  for (int i = 0; i < images; ++i) {
+    RecordImage(stage, seconds[i]);
+    total += seconds[i];
+  }
+  stages_[stage]->per_batch.Record(ToNs(total));
+  return total;
+}
+
+inline void StageTimer::RecordBatch(int stage, double seconds, int images) {
+  Stage& s = *stages_[stage];
+  s.per_batch.Record(ToNs(seconds));
+  if (s.unit == PER_BATCH && images > 0)
+    s.per_image.Record(ToNs(seconds / images), images);
+}
+
+inline void StageTimer::PrintRow(std::ostream& out, const char* title, const LatencyHistogram& h) {
+  const double ms = 1e-6;
+  out << "  " << std::left << std::setw(12) << title << std::right
+      << std::setw(8) << h.count()
+      << std::setw(10) << h.mean() * ms
+      << std::setw(10) << h.Percentile(50) * ms
+      << std::setw(10) << h.Percentile(95) * ms
+      << std::setw(10) << h.Percentile(99) * ms
+      << std::setw(10) << h.max() * ms << std::endl;
+}
+
+inline void StageTimer::Print(std::ostream& out) const {
+  std::ios::fmtflags flags = out.flags();
+  out << std::fixed << std::setprecision(3);
+  out << std::left << std::setw(14) << "Stage, ms" << std::right
+      << std::setw(8) << "count"
+      << std::setw(10) << "mean"
+      << std::setw(10) << "p50"
+      << std::setw(10) << "p95"
+      << std::setw(10) << "p99"
+      << std::setw(10) << "max" << std::endl;
+  for (size_t i = 0; i < stages_.size(); ++i) {
+    const Stage& s = *stages_[i];
+    out << s.name << std::endl;
+    PrintRow(out, "per image", s.per_image);
+    PrintRow(out, "per batch", s.per_batch);
+  }
+  out.flags(flags);
+}
+
+inline void StageTimer::WriteJson(JsonWriter& json, const LatencyHistogram& h) {
+  const double ms = 1e-6;
+  json.BeginObject()
+      .Field("count", h.count())
+      .Field("mean", h.mean() * ms)
+      .Field("min", h.min() * ms)
+      .Field("p50", h.Percentile(50) * ms)
+      .Field("p90", h.Percentile(90) * ms)
+      .Field("p95", h.Percentile(95) * ms)
+      .Field("p99", h.Percentile(99) * ms)
+      .Field("max", h.max() * ms)
+      .EndObject();
+}
+
+inline void StageTimer::WriteJson(JsonWriter& json) const {
+  json.BeginObject();
+  for (size_t i = 0; i < stages_.size(); ++i) {
+    const Stage& s = *stages_[i];
+    json.Key(s.name.c_str()).BeginObject();
+    WriteJson(json.Key("per_image"), s.per_image);
+    WriteJson(json.Key("per_batch"), s.per_batch);
+    json.EndObject();
+  }
+  json.EndObject();
+}
+
+inline void StageTimer::WriteJson(const std::string& file_name) const {
+  std::ofstream file(file_name.c_str(), std::ofstream::trunc);
+  JsonWriter json(file);
+  json.BeginObject().Key("stages_ms");
+  WriteJson(json);
+  json.EndObject();
+  file << std::endl;
+}
+
+#endif // STAGE_TIMER_H
@@ -0,0 +1,92 @@
+#ifndef TOPK_H
+#define TOPK_H
+
+#if defined(__SSE__) || defined(__x86_64__)
+#define TOPK_SSE
+#include <xmmintrin.h>
+#elif defined(__ARM_NEON) || defined(__ARM_NEON__)
+#define TOPK_NEON
+#include <arm_neon.h>
+#endif
+
+/* Top-K selection without heap allocations.
+ *
+ * The K best scores are kept sorted in a small fixed array, a new value is
+ * put in place by insertion. For classifier outputs almost every value is
+ * below the current K-th score, so values are compared against it four at
+ * a time with SSE or NEON and only groups containing a candidate go through
+ * the insertion. */
+
+template <int K>
+struct TopK {
+  // Number of valid entries, less than K only when there are less than K values.
+  int count = 0;
+  // Scores in descending order and their indices in the source row.
+  float score[K];
+  int index[K];
+
+  // Put the value in place. When K values are already collected,
+  // it should be greater than the last of them, which is dropped.
+  void Insert(float value, int value_index) {
+    int pos = count < K ? count++ : K - 1;
+    while (pos > 0 && score[pos - 1] < value) {
+      score[pos] = score[pos - 1];
+      index[pos] = index[pos - 1];
+      pos--;
+    }
+    score[pos] = value;
+    index[pos] = value_index;
+  }
+};
+
+// Select top K values of a row of n values.
+template <int K>
+void top_k(const float* values, int n, TopK<K>* result) {
+  result->count = 0;
+  int i = 0;
+  for (; i < n && i < K; ++i)
+    result->Insert(values[i], i);
+  if (i == n)
+    return;
+
+  float threshold = result->score[K - 1];
+#if defined(TOPK_SSE)
+  for (; i + 4 <= n; i += 4) {
+    __m128 v = _mm_loadu_ps(values + i);
+    int mask = _mm_movemask_ps(_mm_cmpgt_ps(v, _mm_set1_ps(threshold)));
+    if (!mask)
+      continue;
+    for (int j = 0; j < 4; ++j)
+      if (values[i + j] > threshold) {
+        result->Insert(values[i + j], i + j);
+        threshold = result->score[K - 1];
+      }
+  }
+#elif defined(TOPK_NEON)
+  for (; i + 4 <= n; i += 4) {
+    uint32x4_t gt = vcgtq_f32(vld1q_f32(values + i), vdupq_n_f32(threshold));
+    uint32x2_t any = vorr_u32(vget_low_u32(gt), vget_high_u32(gt));
+    if (!(vget_lane_u32(any, 0) | vget_lane_u32(any, 1)))
+      continue;
+    for (int j = 0; j < 4; ++j)
+      if (values[i + j] > threshold) {
+        result->Insert(values[i + j], i + j);
+        threshold = result->score[K - 1];
+      }
+  }
+#endif
+  for (; i < n; ++i)
+    if (values[i] > threshold) {
+      result->Insert(values[i], i);
+      threshold = result->score[K - 1];
+    }
+}
+
+// Select top K values of every row of a batch of rows of n values each.
+template <int K>
+void top_k_batch(const float* values, int batch, int n, TopK<K>* results) {
+  for (int b = 0; b < batch; ++b)
+    top_k(values + b * n, n, results + b);
+}
+
+#endif // TOPK_H
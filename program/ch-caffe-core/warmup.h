@@ -0,0 +1,102 @@
+#ifndef WARMUP_H
+#define WARMUP_H
+
+#include <algorithm>
+#include <cmath>
+#include <ostream>
+#include <vector>
+
+/* Decides from which iteration a benchmark loop is measured.
+ *
+ * The first `warmup_iters` iterations are always discarded. When a CV
+ * threshold is given, iterations are discarded further until times of the
+ * last `window` discarded iterations vary little enough: their coefficient
+ * of variation (standard deviation divided by mean) is below the threshold.
+ * Caches, allocators and CPU frequency settle down by then. Every iteration
+ * after that is measured. If times don't settle within `max_iters`
+ * iterations, measurement starts anyway, so a run always has results. */
+class WarmupDetector {
+public:
+  WarmupDetector(int warmup_iters, double cv_threshold, int window, int max_iters)
+    : warmup_iters_(warmup_iters), cv_threshold_(cv_threshold),
+      window_(std::max(window, 2)), max_iters_(std::max(max_iters, warmup_iters)),
+      steady_(warmup_iters <= 0 && cv_threshold <= 0) {
+    times_.reserve(window_);
+  }
+
+  // Warmup of a loop over the given number of batches, with settings
+  // clamped so that the last batch is always measured.
+  static WarmupDetector ForBatches(int batches, int warmup_iters, double cv_threshold,
+                                   int window, int max_iters) {
+    const int limit = std::max(batches - 1, 0);
+    return WarmupDetector(std::min(warmup_iters, limit), limit > 0 ? cv_threshold : 0,
+                          window, std::min(max_iters, limit));
+  }
+
+  // Whether the current iteration is measured.
+  bool Measured() const { return steady_; }
+
+  // Account time of a discarded iteration. Does nothing once measured.
+  void Add(double seconds) {
+    if (steady_)
+      return;
+    if (int(times_.size()) < window_)
+      times_.push_back(seconds);
+    else
+      times_[discarded_ % window_] = seconds;
+    discarded_++;
+    if (discarded_ < warmup_iters_)
+      return;
+    if (cv_threshold_ <= 0)
+      steady_ = true;
+    else if (int(times_.size()) == window_ && (cv_ = Cv()) < cv_threshold_)
+      steady_ = converged_ = true;
+    else if (discarded_ >= max_iters_)
+      steady_ = true;
+  }
+
+  // Number of iterations discarded.
+  int Discarded() const { return discarded_; }
+
+  // Whether the steady state was detected by CV, not by iteration limits.
+  bool Converged() const { return converged_; }
+
+  // CV of the window when steady state was detected.
+  double FinalCv() const { return cv_; }
+
+  // Print number of discarded batches and how warmup ended.
+  void Print(std::ostream& out) const {
+    out << "Warmup batches discarded: " << discarded_;
+    if (converged_)
+      out << " (steady state at CV " << cv_ << ")";
+    else if (cv_threshold_ > 0 && discarded_ > 0)
+      out << " (steady state not reached)";
+    out << std::endl;
+  }
+
+private:
+  double Cv() const {
+    double mean = 0;
+    for (double t : times_)
+      mean += t;
+    mean /= times_.size();
+    double variance = 0;
+    for (double t : times_)
+      variance += (t - mean) * (t - mean);
+    variance /= times_.size();
+    return mean > 0 ? std::sqrt(variance) / mean : 0;
+  }
+
+private:
+  const int warmup_iters_;
+  const double cv_threshold_;
+  const int window_;
+  const int max_iters_;
+  std::vector<double> times_;
+  int discarded_ = 0;
+  double cv_ = 0;
+  bool steady_;
+  bool converged_ = false;
+};
+
+#endif // WARMUP_H
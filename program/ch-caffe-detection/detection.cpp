@@ -1,8 +1,12 @@
 #include "detector.h"
+#include "../ch-caffe-core/image_source.h"
+#include "../ch-caffe-core/jpeg_decode.h"
+#include "../ch-caffe-core/json_writer.h"
+#include "../ch-caffe-core/stage_timer.h"
+#include "../ch-caffe-core/warmup.h"
 
 #include <chrono>
 
-#include <boost/algorithm/string.hpp>
 #include <boost/filesystem.hpp>
 
 using namespace std;
@@ -13,6 +17,10 @@ int getenv_i(const char* name, int def) {
   return getenv(name) ? atoi(getenv(name)) : def;
 }
 
+double getenv_f(const char* name, double def) {
+  return getenv(name) ? atof(getenv(name)) : def;
+}
+
 string getenv_s(const char* name) {
   const char* val = getenv(name);
   if (!val || strlen(val) == 0) {
@@ -22,11 +30,21 @@ string getenv_s(const char* name) {
   return string(val);
 }
 
+string getenv_s(const char* name, const string& def) {
+  const char* val = getenv(name);
+  return val ? string(val) : def;
+}
+
 const int BATCH_COUNT = getenv_i("CK_BATCH_COUNT", 1);
 const int BATCH_SIZE = getenv_i("CK_BATCH_SIZE", 1);
 const int IMAGES_COUNT = BATCH_COUNT * BATCH_SIZE;
 const int SKIP_IMAGES = getenv_i("CK_SKIP_IMAGES", 0);
+const int WARMUP_ITERS = getenv_i("CK_WARMUP_ITERS", BATCH_COUNT > 1 ? 1 : 0);
+const double WARMUP_CV = getenv_f("CK_WARMUP_CV", 0);
+const int WARMUP_WINDOW = getenv_i("CK_WARMUP_WINDOW", 5);
+const int WARMUP_MAX_ITERS = getenv_i("CK_WARMUP_MAX_ITERS", BATCH_COUNT / 2);
 const string IMAGES_DIR = getenv_s("CK_ENV_DATASET_IMAGE_DIR");
+const string IMAGE_LIST = getenv_s("CK_IMAGE_LIST", "");
 const string LABEL_MAP = getenv_s("CK_ENV_MODEL_CAFFE_LABELMAP");
 const string WEIGHTS_FILE = getenv_s("CK_ENV_MODEL_CAFFE_WEIGHTS");
 const string TMP_MODEL_FILE = "tmp.prototxt";
@@ -34,33 +52,12 @@ const string MODEL_FILE = (fs::path(getenv_s("CK_ENV_MODEL_CAFFE"))/"deploy.prot
 const string MEAN_FILE = "";
 const string MEAN_VALUE = "104,117,123"; // It came from original example
 const float CONF_THRESHOLD = 0.01; // It came from original example
-
-vector<string> get_images() {
-  const string filter1(".JPG");
-  const string filter2(".JPEG");
-
-  vector<string> all_images;
-  fs::directory_iterator end_iter;
-  for (fs::directory_iterator dir_iter(IMAGES_DIR) ; dir_iter != end_iter ; ++dir_iter){
-    if (!fs::is_regular_file(dir_iter->status())) continue;
-
-    string file = dir_iter->path().string();
-
-    string tmp = boost::to_upper_copy(file);
-    if (tmp.compare(file.size()-filter1.size(), filter1.size(), filter1) != 0 &&
-        tmp.compare(file.size()-filter2.size(), filter2.size(), filter2) != 0) continue;
-
-    all_images.push_back(file);
-  }
-
-  sort(all_images.begin(), all_images.end());
-
-  int last_index = SKIP_IMAGES + IMAGES_COUNT;
-  if (last_index >= all_images.size())
-    last_index = all_images.size()-1;
-
-  return vector<string>(&all_images[SKIP_IMAGES], &all_images[last_index]);
-}
+const int MAX_DETECTIONS = getenv_i("CK_MAX_DETECTIONS", 0);
+const string TIMER_FILE = getenv_s("CK_TIMER_FILE", "tmp-ck-timer.json");
+const string RESULTS_FILE = getenv_s("CK_RESULTS_FILE", "tmp-results.json");
+const bool LAYER_TIMING = getenv_i("CK_LAYER_TIMING", 0) != 0;
+const string LAYER_TIMING_FILE = getenv_s("CK_LAYER_TIMING_FILE", "tmp-layer-timing.json");
+const bool REDUCED_DECODE = getenv_i("CK_REDUCED_DECODE", 0) != 0;
 
 template <typename T>
 void str_replace(string& str, const string& from, const T& to) {
@@ -71,6 +68,45 @@ void str_replace(string& str, const string& from, const T& to) {
   }
 }
 
+// Results file: configuration, detections of every image streamed during
+// the run, then summary and stage timings.
+void begin_results(JsonWriter& json) {
+  json.BeginObject().Field("program", "ch-caffe-detection");
+  json.Key("config").BeginObject()
+      .Field("model_file", MODEL_FILE)
+      .Field("weights_file", WEIGHTS_FILE)
+      .Field("label_map", LABEL_MAP)
+      .Field("images_dir", IMAGES_DIR)
+      .Field("image_list", IMAGE_LIST)
+      .Field("batch_count", BATCH_COUNT)
+      .Field("batch_size", BATCH_SIZE)
+      .Field("skip_images", SKIP_IMAGES)
+      .Field("warmup_iters", WARMUP_ITERS)
+      .Field("warmup_cv", WARMUP_CV)
+      .Field("conf_threshold", double(CONF_THRESHOLD))
+      .Field("max_detections", MAX_DETECTIONS)
+      .Field("reduced_decode", REDUCED_DECODE)
+      .Field("layer_timing", LAYER_TIMING)
+      .EndObject();
+  json.Key("images").BeginArray();
+}
+
+// Every image is an object with file name, batch index and detections
+// above the confidence threshold as [label, score, xmin, ymin, xmax, ymax] arrays.
+void write_detections(JsonWriter& json, int batch_index, const string& image_file, const vector<Detection>& dets) {
+  json.BeginObject()
+      .Field("file", fs::path(image_file).filename().native())
+      .Field("batch", batch_index);
+  json.Key("detections").BeginArray();
+  for (const Detection& det: dets)
+    json.BeginArray()
+        .Value(det.label).Value(double(det.score))
+        .Value(double(det.xmin)).Value(double(det.ymin))
+        .Value(double(det.xmax)).Value(double(det.ymax))
+        .EndArray();
+  json.EndArray().EndObject();
+}
+
 int main(int argc, char** argv) {
   // Otherwise caffe will flood stderr with lot of odd messages
   ::google::InitGoogleLogging(argv[0]);
@@ -79,8 +115,14 @@ int main(int argc, char** argv) {
   cout << "Weights file: " << WEIGHTS_FILE << endl;
   cout << "Label map file: " << LABEL_MAP << endl;
   cout << "Images dir: " << IMAGES_DIR << endl;
+  if (!IMAGE_LIST.empty()) cout << "Image list: " << IMAGE_LIST << endl;
   cout << "Batch count: " << BATCH_COUNT << endl;
   cout << "Batch size: " << BATCH_SIZE << endl;
+  if (MAX_DETECTIONS > 0) cout << "Max detections: " << MAX_DETECTIONS << endl;
+  cout << "Warmup batches: " << WARMUP_ITERS << endl;
+  if (WARMUP_CV > 0) cout << "Warmup CV threshold: " << WARMUP_CV << " over " << WARMUP_WINDOW << " batches" << endl;
+  cout << "Layer timing: " << (LAYER_TIMING ? "on" : "off") << endl;
+  cout << "Reduced decode: " << (REDUCED_DECODE ? "on" : "off") << endl;
 
   // Prepare prototxt
   cout << endl << "Preparing prototxt..." << endl;
@@ -92,7 +134,8 @@ int main(int argc, char** argv) {
 
   // Load processing image filenames
   cout << endl << "Loading image list..." << endl;
-  vector<string> images = get_images();
+  vector<string> images = list_images(IMAGES_DIR, IMAGE_LIST, SKIP_IMAGES, IMAGES_COUNT);
+  CHECK_EQ(images.size(), IMAGES_COUNT) << "Not enough images for the requested batches.";
 
   // Build net
   cout << endl << "Initializing detector..." << endl;
@@ -100,6 +143,23 @@ int main(int argc, char** argv) {
   Detector detector(TMP_MODEL_FILE, WEIGHTS_FILE, MEAN_FILE, MEAN_VALUE);
   duration<double> elapsed = high_resolution_clock::now() - start_time;  
   cout << "Detector initialised in " << elapsed.count() << "s" << endl;
+  detector.EnableLayerTiming(LAYER_TIMING);
+  detector.SetConfidenceThreshold(CONF_THRESHOLD);
+  detector.SetMaxDetections(MAX_DETECTIONS);
+
+  // Timings of processing stages
+  StageTimer timer;
+  const int DECODE_STAGE = timer.AddStage("decode", StageTimer::PER_IMAGE);
+  const int PREPROCESS_STAGE = timer.AddStage("preprocess", StageTimer::PER_BATCH);
+  const int FORWARD_STAGE = timer.AddStage("forward", StageTimer::PER_BATCH);
+  const int POSTPROCESS_STAGE = timer.AddStage("postprocess", StageTimer::PER_BATCH);
+  vector<double> decode_times(BATCH_SIZE);
+  vector<cv::Mat> imgs(BATCH_SIZE);
+  vector<vector<Detection> > dets;
+
+  JsonFile results(RESULTS_FILE);
+  if (results.enabled())
+    begin_results(results.json());
 
   // Run batched mode
   cout << endl << "Detect..." << endl;
@@ -107,49 +167,104 @@ int main(int argc, char** argv) {
   double det_total_time = 0;
   int image_index = 0;
   int images_processed = 0;
+  time_point<high_resolution_clock> loop_start_time = high_resolution_clock::now();
+  WarmupDetector warmup = WarmupDetector::ForBatches(BATCH_COUNT, WARMUP_ITERS, WARMUP_CV,
+                                                     WARMUP_WINDOW, WARMUP_MAX_ITERS);
   for (int batch_index = 0; batch_index < BATCH_COUNT; batch_index++) {
     cout << "Batch " << batch_index << endl;
 
-    // Detect batch
-    for (int i = 0; i < BATCH_SIZE; i++) {
-      cout << endl << fs::path(images[image_index]).filename().native() << endl;
-
-      // Load image
-      start_time = high_resolution_clock::now();
-      cv::Mat img = cv::imread(images[image_index], -1);
-      CHECK(!img.empty()) << "Unable to decode image " << images[image_index];
-      elapsed = high_resolution_clock::now() - start_time;  
-      load_total_time += elapsed.count();
+    // Exclude warmup batches from averaging
+    const bool measured = warmup.Measured();
 
-      // Detect
+    // Load images
+    for (int i = 0; i < BATCH_SIZE; i++) {
       start_time = high_resolution_clock::now();
-      vector<Detection> dets = detector.Detect(img);
+      imgs[i] = REDUCED_DECODE ? decode_image_reduced(images[image_index + i], detector.InputGeometry())
+                               : cv::imread(images[image_index + i], -1);
+      CHECK(!imgs[i].empty()) << "Unable to decode image " << images[image_index + i];
       elapsed = high_resolution_clock::now() - start_time;
+      load_total_time += elapsed.count();
+      decode_times[i] = elapsed.count();
+    }
 
-      // Print detections
-      for (auto det: dets)
-        if (det.score >= CONF_THRESHOLD)
-          cout << det.str() << endl;
+    // Detect batch
+    start_time = high_resolution_clock::now();
+    detector.SetInputBatch(imgs);
+    time_point<high_resolution_clock> input_time = high_resolution_clock::now();
+    detector.Forward();
+    time_point<high_resolution_clock> forward_time = high_resolution_clock::now();
+    detector.GetDetections(BATCH_SIZE, &dets);
+    elapsed = high_resolution_clock::now() - start_time;
 
-      // Exclude first batch from averaging
-      if (batch_index > 0 || BATCH_COUNT == 1) {
-        det_total_time += elapsed.count();
-        images_processed += BATCH_SIZE;
-      }
+    // Print detections of every image
+    for (int i = 0; i < BATCH_SIZE; i++) {
+      cout << endl << fs::path(images[image_index + i]).filename().native() << endl;
+      for (const Detection& det: dets[i])
+        cout << det.str() << endl;
+      if (results.enabled())
+        write_detections(results.json(), batch_index, images[image_index + i], dets[i]);
+    }
+    duration<double> postprocess_elapsed = high_resolution_clock::now() - forward_time;
 
-      image_index++;
+    if (measured) {
+      det_total_time += elapsed.count();
+      images_processed += BATCH_SIZE;
+      timer.RecordImages(DECODE_STAGE, decode_times.data(), BATCH_SIZE);
+      timer.RecordBatch(PREPROCESS_STAGE, duration<double>(input_time - start_time).count(), BATCH_SIZE);
+      timer.RecordBatch(FORWARD_STAGE, duration<double>(forward_time - input_time).count(), BATCH_SIZE);
+      timer.RecordBatch(POSTPROCESS_STAGE, postprocess_elapsed.count(), BATCH_SIZE);
     }
+    else {
+      // Layer timings of warmup batches are excluded too
+      detector.ResetLayerTimings();
+    }
+    warmup.Add(elapsed.count());
+
+    image_index += BATCH_SIZE;
   }
 
+  duration<double> loop_elapsed = high_resolution_clock::now() - loop_start_time;
   double det_avg_time = det_total_time / double(images_processed);
 
   cout << endl;
   cout << "Images processed: " << images_processed << endl;
+  warmup.Print(cout);
+  cout << "Network reshapes: " << detector.ReshapeCount() << endl;
   cout << "All images loaded in " << load_total_time << "s" << endl;
   cout << "All images detected in " << det_total_time << "s" << endl;
-  cout << "Average detection time: " << det_avg_time << "s";
-  if (BATCH_COUNT > 1) cout << " (first batch excluded)";
+  cout << "Average detection time: " << det_avg_time << "s" << endl;
+  cout << "Detection throughput: " << 1.0 / det_avg_time << " images/s" << endl;
+  cout << "End-to-end throughput: " << IMAGES_COUNT / loop_elapsed.count() << " images/s" << endl;
+
   cout << endl;
+  timer.Print(cout);
+  if (!TIMER_FILE.empty())
+    timer.WriteJson(TIMER_FILE);
+  if (results.enabled()) {
+    JsonWriter& json = results.json();
+    json.EndArray();
+    json.Key("summary").BeginObject()
+        .Field("images_processed", images_processed)
+        .Field("warmup_batches", warmup.Discarded())
+        .Field("network_reshapes", detector.ReshapeCount())
+        .Field("load_total_time_s", load_total_time)
+        .Field("detection_total_time_s", det_total_time)
+        .Field("avg_detection_time_s", det_avg_time)
+        .Field("detection_throughput", 1.0 / det_avg_time)
+        .Field("end_to_end_throughput", IMAGES_COUNT / loop_elapsed.count())
+        .EndObject();
+    json.Key("stages_ms");
+    timer.WriteJson(json);
+    json.EndObject();
+    results.Close();
+  }
+
+  if (LAYER_TIMING) {
+    cout << endl;
+    detector.PrintLayerTimings(cout);
+    if (!LAYER_TIMING_FILE.empty())
+      detector.WriteLayerTimingsJson(LAYER_TIMING_FILE);
+  }
 
   return 0;
 }
@@ -0,0 +1,85 @@
+#include "detector.h"
+
+#include <algorithm>
+
+Detector::Detector(const string& model_file,
+                   const string& weights_file,
+                   const string& mean_file,
+                   const string& mean_value)
+  : CaffeRunner(model_file, weights_file) {
+  /* Load the mean file or parse mean values. */
+  SetMean(mean_file, mean_value);
+}
+
+std::vector<Detection> Detector::Detect(const cv::Mat& img) {
+  SetInput(img);
+  Forward();
+  std::vector<std::vector<Detection> > detections;
+  GetDetections(1, &detections);
+  return detections[0];
+}
+
+void Detector::DetectBatch(const std::vector<cv::Mat>& imgs,
+                           std::vector<std::vector<Detection> >* detections) {
+  SetInputBatch(imgs);
+  Forward();
+  GetDetections(imgs.size(), detections);
+}
+
+void Detector::SetInput(const cv::Mat& img) {
+  cv::Mat prepared = PrepareImage(img);
+  SetInput(&prepared, 1);
+}
+
+void Detector::SetInputBatch(const std::vector<cv::Mat>& imgs) {
+  /* Every image of the batch is resized into its own arena slot. */
+  ReservePrepareSlots(imgs.size());
+  prepared_.resize(imgs.size());
+  for (size_t i = 0; i < imgs.size(); ++i)
+    prepared_[i] = PrepareImage(imgs[i], i);
+  SetInput(prepared_);
+}
+
+void Detector::GetDetections(int num_images, std::vector<std::vector<Detection> >* detections) const {
+  /* Output of DetectionOutput layer is a single list of
+   * [image_id, label, score, xmin, ymin, xmax, ymax] rows
+   * for the whole batch, image_id is the index of image in the batch.
+   * Most of rows usually have low scores, they are skipped
+   * before anything is copied. */
+  Blob<float>* result_blob = net_->output_blobs()[0];
+  const float* result = result_blob->cpu_data();
+  const int num_det = result_blob->height();
+  detections->resize(num_images);
+  for (int i = 0; i < num_images; ++i)
+    (*detections)[i].clear();
+  for (int k = 0; k < num_det; ++k, result += 7) {
+    const int image_id = static_cast<int>(result[0]);
+    if (image_id < 0 || image_id >= num_images) {
+      // Skip invalid detection.
+      continue;
+    }
+    const float score = result[2];
+    if (score < conf_threshold_)
+      continue;
+    vector<Detection>& image_detections = (*detections)[image_id];
+    Detection* detection;
+    if (max_detections_ <= 0 || int(image_detections.size()) < max_detections_) {
+      image_detections.resize(image_detections.size() + 1);
+      detection = &image_detections.back();
+    }
+    else {
+      /* Replace the worst kept detection when this one is better. */
+      detection = &*std::min_element(image_detections.begin(), image_detections.end(),
+        [](const Detection& a, const Detection& b) { return a.score < b.score; });
+      if (detection->score >= score)
+        continue;
+    }
+    detection->image_id = image_id;
+    detection->label = static_cast<int>(result[1]);
+    detection->score = score;
+    detection->xmin = result[3];
+    detection->ymin = result[4];
+    detection->xmax = result[5];
+    detection->ymax = result[6];
+  }
+}
@@ -1,12 +1,14 @@
 #ifndef DETECTOR_H
 #define DETECTOR_H
 
-#include <caffe/caffe.hpp>
+#include "../ch-caffe-core/caffe_runner.h"
 
 #include <opencv2/core/core.hpp>
 #include <opencv2/highgui/highgui.hpp>
 #include <opencv2/imgproc/imgproc.hpp>
 
+#include <iomanip>
+#include <sstream>
 #include <vector>
 #include <string>
 
@@ -34,210 +36,43 @@ struct Detection {
   }
 };
 
-class Detector {
+class Detector : public CaffeRunner {
  public:
   Detector(const string& model_file,
            const string& weights_file,
            const string& mean_file,
            const string& mean_value);
 
-  std::vector<Detection> Detect(const cv::Mat& img);
+  // Detections with lower score are dropped while reading the output.
+  // Default is 0, all valid detections are kept.
+  void SetConfidenceThreshold(float threshold) { conf_threshold_ = threshold; }
 
- private:
-  void SetMean(const string& mean_file, const string& mean_value);
+  // Keep at most this number of best scored detections of every image.
+  // Default is 0, no limit.
+  void SetMaxDetections(int max_detections) { max_detections_ = max_detections; }
 
-  void WrapInputLayer(std::vector<cv::Mat>* input_channels);
+  std::vector<Detection> Detect(const cv::Mat& img);
 
-  void Preprocess(const cv::Mat& img,
-                  std::vector<cv::Mat>* input_channels);
+  // Detect objects on several images with a single forward pass.
+  // Detections of every image, in order of images, are written into
+  // the caller's buffer. Its vectors are cleared but keep their memory,
+  // so a buffer reused for every batch stops allocating after a few batches.
+  void DetectBatch(const std::vector<cv::Mat>& imgs,
+                   std::vector<std::vector<Detection> >* detections);
+
+  // Steps of Detect and DetectBatch, for timing them separately.
+  // Preprocess images and write them into the input layer of the network.
+  using CaffeRunner::SetInput;
+  void SetInput(const cv::Mat& img);
+  void SetInputBatch(const std::vector<cv::Mat>& imgs);
+  // Collect detections from the output layer, filtered by confidence
+  // and split by images of the batch of `num_images` images.
+  void GetDetections(int num_images, std::vector<std::vector<Detection> >* detections) const;
 
  private:
-  shared_ptr<Net<float> > net_;
-  cv::Size input_geometry_;
-  int num_channels_;
-  cv::Mat mean_;
+  std::vector<cv::Mat> prepared_;
+  float conf_threshold_ = 0;
+  int max_detections_ = 0;
 };
 
-Detector::Detector(const string& model_file,
-                   const string& weights_file,
-                   const string& mean_file,
-                   const string& mean_value) {
-#ifdef CPU_ONLY
-  Caffe::set_mode(Caffe::CPU);
-#else
-  Caffe::set_mode(Caffe::GPU);
-#endif
-
-  /* Load the network. */
-  net_.reset(new Net<float>(model_file, TEST));
-  net_->CopyTrainedLayersFrom(weights_file);
-
-  CHECK_EQ(net_->num_inputs(), 1) << "Network should have exactly one input.";
-  CHECK_EQ(net_->num_outputs(), 1) << "Network should have exactly one output.";
-
-  Blob<float>* input_layer = net_->input_blobs()[0];
-  num_channels_ = input_layer->channels();
-  CHECK(num_channels_ == 3 || num_channels_ == 1)
-    << "Input layer should have 1 or 3 channels.";
-  input_geometry_ = cv::Size(input_layer->width(), input_layer->height());
-
-  /* Load the binaryproto mean file. */
-  SetMean(mean_file, mean_value);
-}
-
-std::vector<Detection> Detector::Detect(const cv::Mat& img) {
-  Blob<float>* input_layer = net_->input_blobs()[0];
-  input_layer->Reshape(1, num_channels_,
-                       input_geometry_.height, input_geometry_.width);
-  /* Forward dimension change to all layers. */
-  net_->Reshape();
-
-  std::vector<cv::Mat> input_channels;
-  WrapInputLayer(&input_channels);
-
-  Preprocess(img, &input_channels);
-
-  net_->Forward();
-
-  /* Copy the output layer to a std::vector */
-  Blob<float>* result_blob = net_->output_blobs()[0];
-  const float* result = result_blob->cpu_data();
-  const int num_det = result_blob->height();
-  vector<Detection> detections;
-  for (int k = 0; k < num_det; ++k) {
-    if (result[0] == -1) {
-      // Skip invalid detection.
-      result += 7;
-      continue;
-    }
-    Detection detection;
-    detection.image_id = static_cast<int>(result[0]);
-    detection.label = static_cast<int>(result[1]);
-    detection.score = result[2];
-    detection.xmin = result[3];
-    detection.ymin = result[4];
-    detection.xmax = result[5];
-    detection.ymax = result[6];
-    detections.push_back(detection);
-    result += 7;
-  }
-  return detections;
-}
-
-/* Load the mean file in binaryproto format. */
-void Detector::SetMean(const string& mean_file, const string& mean_value) {
-  cv::Scalar channel_mean;
-  if (!mean_file.empty()) {
-    CHECK(mean_value.empty()) <<
-      "Cannot specify mean_file and mean_value at the same time";
-    BlobProto blob_proto;
-    ReadProtoFromBinaryFileOrDie(mean_file.c_str(), &blob_proto);
-
-    /* Convert from BlobProto to Blob<float> */
-    Blob<float> mean_blob;
-    mean_blob.FromProto(blob_proto);
-    CHECK_EQ(mean_blob.channels(), num_channels_)
-      << "Number of channels of mean file doesn't match input layer.";
-
-    /* The format of the mean file is planar 32-bit float BGR or grayscale. */
-    std::vector<cv::Mat> channels;
-    float* data = mean_blob.mutable_cpu_data();
-    for (int i = 0; i < num_channels_; ++i) {
-      /* Extract an individual channel. */
-      cv::Mat channel(mean_blob.height(), mean_blob.width(), CV_32FC1, data);
-      channels.push_back(channel);
-      data += mean_blob.height() * mean_blob.width();
-    }
-
-    /* Merge the separate channels into a single image. */
-    cv::Mat mean;
-    cv::merge(channels, mean);
-
-    /* Compute the global mean pixel value and create a mean image
-     * filled with this value. */
-    channel_mean = cv::mean(mean);
-    mean_ = cv::Mat(input_geometry_, mean.type(), channel_mean);
-  }
-  if (!mean_value.empty()) {
-    CHECK(mean_file.empty()) <<
-      "Cannot specify mean_file and mean_value at the same time";
-    stringstream ss(mean_value);
-    vector<float> values;
-    string item;
-    while (getline(ss, item, ',')) {
-      float value = std::atof(item.c_str());
-      values.push_back(value);
-    }
-    CHECK(values.size() == 1 || values.size() == num_channels_) <<
-      "Specify either 1 mean_value or as many as channels: " << num_channels_;
-
-    std::vector<cv::Mat> channels;
-    for (int i = 0; i < num_channels_; ++i) {
-      /* Extract an individual channel. */
-      cv::Mat channel(input_geometry_.height, input_geometry_.width, CV_32FC1,
-          cv::Scalar(values[i]));
-      channels.push_back(channel);
-    }
-    cv::merge(channels, mean_);
-  }
-}
-
-/* Wrap the input layer of the network in separate cv::Mat objects
- * (one per channel). This way we save one memcpy operation and we
- * don't need to rely on cudaMemcpy2D. The last preprocessing
- * operation will write the separate channels directly to the input
- * layer. */
-void Detector::WrapInputLayer(std::vector<cv::Mat>* input_channels) {
-  Blob<float>* input_layer = net_->input_blobs()[0];
-
-  int width = input_layer->width();
-  int height = input_layer->height();
-  float* input_data = input_layer->mutable_cpu_data();
-  for (int i = 0; i < input_layer->channels(); ++i) {
-    cv::Mat channel(height, width, CV_32FC1, input_data);
-    input_channels->push_back(channel);
-    input_data += width * height;
-  }
-}
-
-void Detector::Preprocess(const cv::Mat& img,
-                            std::vector<cv::Mat>* input_channels) {
-  /* Convert the input image to the input image format of the network. */
-  cv::Mat sample;
-  if (img.channels() == 3 && num_channels_ == 1)
-    cv::cvtColor(img, sample, cv::COLOR_BGR2GRAY);
-  else if (img.channels() == 4 && num_channels_ == 1)
-    cv::cvtColor(img, sample, cv::COLOR_BGRA2GRAY);
-  else if (img.channels() == 4 && num_channels_ == 3)
-    cv::cvtColor(img, sample, cv::COLOR_BGRA2BGR);
-  else if (img.channels() == 1 && num_channels_ == 3)
-    cv::cvtColor(img, sample, cv::COLOR_GRAY2BGR);
-  else
-    sample = img;
-
-  cv::Mat sample_resized;
-  if (sample.size() != input_geometry_)
-    cv::resize(sample, sample_resized, input_geometry_);
-  else
-    sample_resized = sample;
-
-  cv::Mat sample_float;
-  if (num_channels_ == 3)
-    sample_resized.convertTo(sample_float, CV_32FC3);
-  else
-    sample_resized.convertTo(sample_float, CV_32FC1);
-
-  cv::Mat sample_normalized;
-  cv::subtract(sample_float, mean_, sample_normalized);
-
-  /* This operation will write the separate BGR planes directly to the
-   * input layer of the network because it is wrapped by the cv::Mat
-   * objects in input_channels. */
-  cv::split(sample_normalized, *input_channels);
-
-  CHECK(reinterpret_cast<float*>(input_channels->at(0).data)
-        == net_->input_blobs()[0]->cpu_data())
-    << "Input channels are not wrapping the input layer of the network.";
-}
-
 #endif // DETECTOR_H
@@ -0,0 +1,216 @@
+#include "../ch-caffe-core/caffe_datum.h"
+
+#include <iostream>
+#include <cstdint>
+#include <chrono>
+#include <random>
+#include <string>
+#include <vector>
+
+using namespace std;
+
+// Microbenchmark of varint decoding used by CaffeDatum::parse.
+// Decoders are checked against known values first, the result
+// is printed as OK or FAIL and returned as the exit code.
+
+namespace {
+
+// Value loop of the former CaffeDatum::parse_int: one signed char at a time,
+// accumulated into 32 bits. Shifts are kept below 32, so it has no undefined
+// behaviour on long varints, but decodes them wrong as before.
+int decode_varint_legacy(const char* buf, int& index) {
+  const char MSB = 0x8<<4;
+  char byte = buf[index++];
+  bool has_next = byte & MSB;
+  char seven_bits = byte & ~MSB;
+  unsigned value = seven_bits;
+  int shift = 7;
+  while (has_next) {
+    byte = buf[index++];
+    has_next = byte & MSB;
+    seven_bits = byte & ~MSB;
+    if (shift < 32)
+      value |= unsigned(seven_bits) << shift;
+    shift += 7;
+  }
+  return int(value);
+}
+
+void encode_varint(uint64_t value, string& out) {
+  while (value >= 0x80) {
+    out.push_back(char(value | 0x80));
+    value >>= 7;
+  }
+  out.push_back(char(value));
+}
+
+// Values of every length from 1 to 10 bytes, mostly short ones
+// like sizes and labels of Datum messages.
+vector<uint64_t> make_values(int count) {
+  mt19937_64 rng(42);
+  vector<uint64_t> values(count);
+  for (int i = 0; i < count; i++) {
+    const int r = rng() % 10;
+    const int bytes = r < 5 ? 1 : r < 7 ? 2 : 3 + rng() % 8;
+    const int bits = 7 * bytes;
+    values[i] = bits >= 64 ? rng() | (uint64_t(1) << 63)
+                           : (rng() & ((uint64_t(1) << bits) - 1)) | (uint64_t(1) << (bits - 1));
+  }
+  return values;
+}
+
+bool check(bool ok, const char* what) {
+  if (!ok)
+    cout << "Check failed: " << what << endl;
+  return ok;
+}
+
+bool check_decoder(int (*decode)(const uint8_t*, const uint8_t*, uint64_t*), const char* name) {
+  cout << "Checking " << name << "..." << endl;
+  bool ok = true;
+  uint64_t value = 0;
+  auto decode_str = [&](const string& s) {
+    const uint8_t* p = reinterpret_cast<const uint8_t*>(s.data());
+    return decode(p, p + s.size(), &value);
+  };
+  string padded_max = string("\xff\xff\xff\xff\xff\xff\xff\xff\xff\x01", 10) + string(8, '\0');
+  ok &= check(decode_str(string("\x96\x01", 2)) == 2 && value == 150, "two bytes");
+  ok &= check(decode_str(string("\x96\x01", 2) + string(8, '\0')) == 2 && value == 150, "two bytes, padded");
+  ok &= check(decode_str(padded_max) == 10 && value == UINT64_MAX, "max value");
+  ok &= check(decode_str(string("\x80\x80", 2)) == 0, "truncated");
+  ok &= check(decode_str(string("\xff\xff\xff\xff\xff\xff\xff\xff", 8)) == 0, "truncated at 8 bytes");
+  ok &= check(decode_str(string("\xff\xff\xff\xff\xff\xff\xff\xff\xff\x02", 10)) == 0, "overflow");
+  ok &= check(decode_str(string(11, '\x80') + string(1, '\0')) == 0, "too long");
+  return ok;
+}
+
+bool check_datum() {
+  cout << "Checking CaffeDatum..." << endl;
+  bool ok = true;
+  string msg;
+  msg += '\x08'; encode_varint(3, msg);                     // channels
+  msg += '\x10'; encode_varint(300, msg);                   // height
+  msg += '\x18'; encode_varint(200, msg);                   // width
+  msg += '\x22'; encode_varint(4, msg); msg += "\x01\x02\x03\x04"; // data
+  msg += '\x28'; encode_varint(999, msg);                   // label
+  msg += '\x32'; encode_varint(8, msg); msg += string(8, '\0');    // packed float_data
+  msg += '\x3d'; msg += string(4, '\0');                    // unknown fixed32
+  msg += '\x41'; msg += string(8, '\0');                    // unknown fixed64
+  msg += '\x38'; encode_varint(1, msg);                     // encoded
+  CaffeDatum datum;
+  try {
+    datum.parse(msg.data(), msg.size());
+  }
+  catch (const runtime_error& err) {
+    cout << "Unexpected error: " << err.what() << endl;
+    return false;
+  }
+  ok &= check(datum.channels == 3 && datum.height == 300 && datum.width == 200, "geometry");
+  ok &= check(datum.label == 999 && datum.encoded, "label and encoded");
+  ok &= check(datum.image_bytes == 4 && datum.data == msg.data() + 10, "data");
+  ok &= check(datum.float_count == 2 && reinterpret_cast<const char*>(datum.float_data) == msg.data() + 19,
+              "float_data");
+
+  // Floats written one by one are rejected
+  string unpacked = msg + "\x35" + string(4, '\0');
+  try {
+    CaffeDatum d;
+    d.parse(unpacked.data(), unpacked.size());
+    ok &= check(false, "unpacked float_data");
+  }
+  catch (const runtime_error&) {
+  }
+
+  // Every truncation of the message should be rejected or parsed
+  // without reading out of it; those ending inside a field throw.
+  int rejected = 0;
+  for (size_t size = 0; size < msg.size(); size++) {
+    string truncated = msg.substr(0, size);
+    try {
+      CaffeDatum d;
+      d.parse(truncated.data(), truncated.size());
+    }
+    catch (const runtime_error&) {
+      rejected++;
+    }
+  }
+  ok &= check(rejected > 0, "truncated messages");
+  return ok;
+}
+
+template <typename Decode>
+void time_decoder(const char* name, int repeats, int count, Decode decode) {
+  chrono::time_point<chrono::high_resolution_clock> start_time = chrono::high_resolution_clock::now();
+  uint64_t sum = 0;
+  for (int r = 0; r < repeats; r++)
+    sum += decode();
+  chrono::duration<double> elapsed = chrono::high_resolution_clock::now() - start_time;
+  const double total = double(repeats) * count;
+  cout << name << ": " << elapsed.count() * 1e9 / total << " ns/varint, "
+       << total / elapsed.count() / 1e6 << " M varints/s (checksum " << sum << ")" << endl;
+}
+
+} // namespace
+
+int bench_varint() {
+  const int COUNT = 1 << 20;
+  const int REPEATS = 20;
+
+  bool ok = check_decoder(decode_varint_bytewise, "bytewise decoder");
+  ok &= check_decoder(decode_varint, "fast decoder");
+  ok &= check_datum();
+
+  vector<uint64_t> values = make_values(COUNT);
+  string encoded;
+  for (uint64_t value : values)
+    encode_varint(value, encoded);
+  const uint8_t* begin = reinterpret_cast<const uint8_t*>(encoded.data());
+  const uint8_t* end = begin + encoded.size();
+  cout << "Values: " << COUNT << ", encoded bytes: " << encoded.size() << endl;
+
+  // Both decoders should return all the values back
+  int wrong_fast = 0, wrong_bytewise = 0, wrong_legacy = 0;
+  const uint8_t* p = begin;
+  const uint8_t* q = begin;
+  int index = 0;
+  for (int i = 0; i < COUNT; i++) {
+    uint64_t value = 0;
+    int bytes = decode_varint(p, end, &value);
+    wrong_fast += bytes == 0 || value != values[i];
+    p += bytes ? bytes : 1;
+    bytes = decode_varint_bytewise(q, end, &value);
+    wrong_bytewise += bytes == 0 || value != values[i];
+    q += bytes ? bytes : 1;
+    wrong_legacy += uint64_t(unsigned(decode_varint_legacy(encoded.data(), index))) != values[i];
+  }
+  ok &= check(wrong_fast == 0, "fast decoder values");
+  ok &= check(wrong_bytewise == 0, "bytewise decoder values");
+  cout << "Values decoded wrong by legacy loop: " << wrong_legacy << endl;
+
+  time_decoder("Legacy loop", REPEATS, COUNT, [&]() {
+    uint64_t sum = 0;
+    int index = 0;
+    for (int i = 0; i < COUNT; i++)
+      sum += unsigned(decode_varint_legacy(encoded.data(), index));
+    return sum;
+  });
+  time_decoder("Bytewise decoder", REPEATS, COUNT, [&]() {
+    uint64_t sum = 0, value = 0;
+    for (const uint8_t* p = begin; p < end; ) {
+      p += decode_varint_bytewise(p, end, &value);
+      sum += value;
+    }
+    return sum;
+  });
+  time_decoder("Fast decoder", REPEATS, COUNT, [&]() {
+    uint64_t sum = 0, value = 0;
+    for (const uint8_t* p = begin; p < end; ) {
+      p += decode_varint(p, end, &value);
+      sum += value;
+    }
+    return sum;
+  });
+
+  cout << "Varint decoder: " << (ok ? "OK" : "FAIL") << endl;
+  return ok ? 0 : 1;
+}